@@ -0,0 +1,101 @@
+#include "AudioAnalyzer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const float kBandEdges[AudioAnalyzer::NUM_BANDS + 1] = {20, 250, 4000, 16000};
+// Time constants of the smoothed levels and of their averages
+static const float kAttackSeconds = 0.05f;
+static const float kAverageSeconds = 3;
+// Below this normalized power (about -60dB) a band counts as silent
+static const float kSilence = 1e-6f;
+// A beat is the bass jumping this far above its average, at most
+// every kBeatHoldSeconds (300 BPM)
+static const float kBeatThreshold = 1.5f;
+static const float kBeatHoldSeconds = 0.2f;
+
+static_assert((AudioAnalyzer::kFFTSize & (AudioAnalyzer::kFFTSize - 1)) == 0, "FFT size must be a power of two");
+
+AudioAnalyzer::AudioAnalyzer() {
+  for (int i = 0; i < kFFTSize; ++i) {
+    window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / kFFTSize);
+  }
+  for (int i = 0; i < kFFTSize / 2; ++i) {
+    twiddles[i] = std::polar(1.f, (float)(-2 * M_PI * i / kFFTSize));
+  }
+  setSampleRate(44100);
+}
+
+void AudioAnalyzer::setSampleRate(float r) {
+  rate = r > 0 ? r : 44100;
+  for (int b = 0; b <= NUM_BANDS; ++b) {
+    bandBins[b] = std::min(kFFTSize / 2, std::max(1, (int)(kBandEdges[b] * kFFTSize / rate + 0.5f)));
+  }
+  memset(samples, 0, sizeof(samples));
+  writePos = 0;
+  filled = 0;
+  for (int b = 0; b < NUM_BANDS; ++b) {
+    smoothed[b] = average[b] = levels[b] = 0;
+  }
+  previousBass = 0;
+  sinceBeat = 0;
+}
+
+void AudioAnalyzer::process(const StereoFrame* f, int n) {
+  for (int i = 0; i < n; ++i) {
+    samples[writePos] = 0.5f * (f[i].l + f[i].r);
+    writePos = (writePos + 1) & (kFFTSize - 1);
+    if (++filled == kHop) {
+      analyze();
+      filled = 0;
+    }
+  }
+}
+
+void AudioAnalyzer::analyze() {
+  // Iterative radix-2 FFT, input oldest first in bit-reversed order
+  for (int i = 0, j = 0; i < kFFTSize; ++i) {
+    spectrum[j] = std::complex<float>(samples[(writePos + i) & (kFFTSize - 1)] * window[i], 0);
+    int bit = kFFTSize >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j |= bit;
+  }
+  for (int len = 2; len <= kFFTSize; len <<= 1) {
+    int stride = kFFTSize / len;
+    for (int i = 0; i < kFFTSize; i += len) {
+      for (int k = 0; k < len / 2; ++k) {
+	std::complex<float> t = twiddles[k * stride] * spectrum[i + k + len / 2];
+	spectrum[i + k + len / 2] = spectrum[i + k] - t;
+	spectrum[i + k] += t;
+      }
+    }
+  }
+
+  float dt = kHop / rate;
+  float attack = 1 - expf(-dt / kAttackSeconds);
+  float settle = 1 - expf(-dt / kAverageSeconds);
+  // A full scale sine peaks at kFFTSize / 4 through the Hann window
+  const float norm = 16.f / ((float)kFFTSize * kFFTSize);
+  float power[NUM_BANDS];
+  for (int b = 0; b < NUM_BANDS; ++b) {
+    power[b] = 0;
+    for (int i = bandBins[b]; i < bandBins[b + 1]; ++i) {
+      power[b] += std::norm(spectrum[i]);
+    }
+    power[b] *= norm;
+    smoothed[b] += attack * (power[b] - smoothed[b]);
+    // Out of silence, start from where the sound is rather than
+    // taking seconds to rise to it
+    average[b] = average[b] > kSilence ? average[b] + settle * (power[b] - average[b]) : power[b];
+    levels[b] = average[b] > kSilence ? smoothed[b] / average[b] : 0;
+  }
+
+  // Onsets only: the bass has to be rising, not just loud
+  sinceBeat += dt;
+  if (sinceBeat >= kBeatHoldSeconds && average[BASS] > kSilence &&
+      power[BASS] > kBeatThreshold * average[BASS] && power[BASS] > previousBass) {
+    ++beats;
+    sinceBeat = 0;
+  }
+  previousBass = power[BASS];
+}
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef AUDIO_ANALYZER_HPP
+#define AUDIO_ANALYZER_HPP
+
+#include "PCMBuffer.hpp"
+#include <complex>
+#include <cstdint>
+
+// AudioAnalyzer measures bass, mid and treble energy and detects beats
+// on the audio PCMIngestor produces, on the engine thread, every
+// kHop samples regardless of the visuals' frame rate. Levels are
+// relative to their average over the last few seconds, as in
+// Milkdrop's bass/mid/treb: 1 is average, 2 twice as loud.
+class AudioAnalyzer {
+public:
+  static const int kFFTSize = 1024;
+  static const int kHop = 512; // ~10ms at 48kHz
+
+  enum Band {
+    BASS, // 20-250Hz
+    MID, // 250-4000Hz
+    TREBLE, // 4-16kHz
+    NUM_BANDS
+  };
+
+  AudioAnalyzer();
+
+  // Sets the rate of the audio given to process(). Engine thread only.
+  void setSampleRate(float rate);
+
+  // Takes n frames of audio. Engine thread only.
+  void process(const StereoFrame* f, int n);
+
+  // Smoothed level of band b, relative to its long term average.
+  // Engine thread only.
+  float level(Band b) const { return levels[b]; }
+
+  // Beats detected so far. Engine thread only.
+  uint32_t beatCount() const { return beats; }
+
+private:
+  void analyze();
+
+  float rate = 44100;
+  float window[kFFTSize]; // Hann
+  float samples[kFFTSize]; // Mono, a ring written at writePos
+  int writePos = 0;
+  int filled = 0; // New samples since the last analysis
+  std::complex<float> spectrum[kFFTSize];
+  std::complex<float> twiddles[kFFTSize / 2];
+  int bandBins[NUM_BANDS + 1];
+
+  // Per band, in normalized power
+  float smoothed[NUM_BANDS];
+  float average[NUM_BANDS];
+  float levels[NUM_BANDS];
+  float previousBass = 0;
+  float sinceBeat = 0; // Seconds
+  uint32_t beats = 0;
+};
+
+#endif
@@ -0,0 +1,276 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "FrameCapture.hpp"
+#include "util/common.hpp"
+#include <chrono>
+#include <cstring>
+#ifndef ARCH_WIN
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+FrameCapture::FrameCapture(CaptureSettings const& s) : quit(false), settings(s), written(0), dropped(0) {
+  if (settings.width <= 0) settings.width = 1;
+  if (settings.height <= 0) settings.height = 1;
+  if (settings.fps <= 0) settings.fps = 1;
+  for (size_t i = 0; i < kPoolFrames; ++i) {
+    pool[i].pixels.resize(4 * settings.width * settings.height);
+    recycled.push(&pool[i]);
+  }
+  for (int i = 0; i < kPixelBuffers; ++i) {
+    pixelBuffers[i] = 0;
+    fences[i] = nullptr;
+    repeats[i] = 0;
+  }
+  writer = std::thread([this](){ this->run(); });
+}
+
+FrameCapture::~FrameCapture() {
+  quit.store(true);
+  writer.join();
+}
+
+void FrameCapture::dispose(std::shared_ptr<FrameCapture> c) {
+  if (!c) return;
+  // The thread's copy of c is the one destroyed last, once c here is
+  // gone
+  std::thread([](std::shared_ptr<FrameCapture> c) { c.reset(); }, std::move(c)).detach();
+}
+
+void FrameCapture::initGL() {
+  glGenRenderbuffers(1, &renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, settings.width, settings.height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+  glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+  glGenBuffers(kPixelBuffers, pixelBuffers);
+  for (int i = 0; i < kPixelBuffers; ++i) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, 4 * settings.width * settings.height, nullptr, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glReady = true;
+}
+
+void FrameCapture::releaseGL() {
+  if (!glReady) return;
+  // Whatever is still in flight is worth finishing
+  collect(true);
+  glDeleteBuffers(kPixelBuffers, pixelBuffers);
+  glDeleteFramebuffers(1, &framebuffer);
+  glDeleteRenderbuffers(1, &renderbuffer);
+  glReady = false;
+}
+
+// Hands finished reads, oldest first, to the writer. With wait set,
+// blocks until all of them are finished.
+void FrameCapture::collect(bool wait) {
+  for (int k = 0; k < kPixelBuffers; ++k) {
+    int i = (nextBuffer + k) % kPixelBuffers;
+    if (!fences[i]) continue;
+    GLenum r = glClientWaitSync(fences[i], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+    if (r == GL_TIMEOUT_EXPIRED) break; // Later ones can't be done either
+    glDeleteSync(fences[i]);
+    fences[i] = nullptr;
+    if (r == GL_WAIT_FAILED) continue;
+
+    Frame* f;
+    bool haveFrame = recycled.pop(&f, 1) != 0;
+    while (!haveFrame && settings.lossless) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      haveFrame = recycled.pop(&f, 1) != 0;
+    }
+    if (!haveFrame) {
+      // The writer is behind, drop this one
+      dropped.fetch_add(repeats[i], std::memory_order_relaxed);
+      continue;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[i]);
+    const void* p = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, f->pixels.size(), GL_MAP_READ_BIT);
+    if (p) {
+      memcpy(f->pixels.data(), p, f->pixels.size());
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      f->repeat = repeats[i];
+      filled.push(f);
+    } else {
+      recycled.push(f);
+      dropped.fetch_add(repeats[i], std::memory_order_relaxed);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+}
+
+void FrameCapture::captureFrame(double time, GLuint srcFramebuffer, int srcWidth, int srcHeight) {
+  if (!glReady) initGL();
+  collect(false);
+
+  if (!started) {
+    startTime = time;
+    started = true;
+  }
+  // Output frame times are derived from a count rather than summed
+  // up, so that a render rate equal to the capture rate gives exactly
+  // one output frame per frame. The small tolerance is for rounding.
+  double elapsed = (time - startTime) * settings.fps + 1e-6;
+  if (elapsed < framesDue) return;
+  // When rendering runs slower than the capture rate, this frame
+  // stands for all the output frames that came due since the last one
+  int repeat = 1 + (int)(elapsed - framesDue);
+  framesDue += repeat;
+
+  int i = nextBuffer;
+  if (fences[i] && settings.lossless) {
+    // This is the oldest read, wait for it and hand it over
+    glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    collect(false);
+  }
+  if (fences[i]) {
+    // All pixel buffers are still in flight
+    dropped.fetch_add(repeat, std::memory_order_relaxed);
+    return;
+  }
+
+  // Scale into our target, then start reading it back. The read
+  // returns immediately, the data lands in the pixel buffer later.
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, srcFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+  glBlitFramebuffer(0, 0, srcWidth, srcHeight, 0, 0, settings.width, settings.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[i]);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, settings.width, settings.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  repeats[i] = repeat;
+  nextBuffer = (i + 1) % kPixelBuffers;
+}
+
+// Opens the output. A named pipe can't be opened until something
+// reads from it, so we keep trying without blocking until it can or
+// the capture is stopped.
+FILE* FrameCapture::openOutput() {
+  if (!settings.command.empty()) {
+#ifdef ARCH_WIN
+    return _popen(settings.command.c_str(), "wb");
+#else
+    return popen(settings.command.c_str(), "w");
+#endif
+  }
+#ifdef ARCH_WIN
+  return fopen(settings.path.c_str(), "wb");
+#else
+  while (!quit.load()) {
+    int fd = open(settings.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      return fdopen(fd, "wb");
+    }
+    if (errno != ENXIO) return nullptr;
+    // Frames keep coming in meanwhile, throw them away
+    Frame* f;
+    while (filled.pop(&f, 1)) {
+      dropped.fetch_add(f->repeat, std::memory_order_relaxed);
+      recycled.push(f);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return nullptr;
+#endif
+}
+
+void FrameCapture::run() {
+  out = openOutput();
+#ifndef ARCH_WIN
+  // A reader closing its end of the pipe must not kill Rack. SIGPIPE
+  // goes to the thread that wrote, so blocking it here is enough for
+  // writes to fail with EPIPE instead. Only after popen(), so that the
+  // command doesn't inherit the mask.
+  sigset_t pipe;
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe, nullptr);
+#endif
+  if (!out) {
+    if (!quit.load()) {
+      rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Could not open %s for capture", settings.command.empty() ? settings.path.c_str() : settings.command.c_str());
+    }
+  } else if (settings.format == CaptureSettings::Y4M) {
+    fprintf(out, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C444\n", settings.width, settings.height, (int)(settings.fps * 1000));
+  }
+  row.resize(4 * settings.width);
+
+  while (true) {
+    Frame* f;
+    if (filled.pop(&f, 1)) {
+      if (out) write(*f);
+      else dropped.fetch_add(f->repeat, std::memory_order_relaxed);
+      recycled.push(f);
+    } else if (quit.load()) {
+      break;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+  closeOutput();
+}
+
+void FrameCapture::closeOutput() {
+  if (!out) return;
+  if (settings.command.empty()) {
+    fclose(out);
+  } else {
+#ifdef ARCH_WIN
+    _pclose(out);
+#else
+    pclose(out);
+#endif
+  }
+  out = nullptr;
+}
+
+void FrameCapture::write(Frame const& f) {
+  const int w = settings.width, h = settings.height;
+  for (int n = 0; n < f.repeat; ++n) {
+    bool ok = true;
+    if (settings.format == CaptureSettings::RAW_RGBA) {
+      // GL rows are bottom-up, video is top-down
+      for (int y = h - 1; y >= 0 && ok; --y) {
+	ok = fwrite(&f.pixels[4 * w * y], 4 * w, 1, out) == 1;
+      }
+    } else {
+      ok = fputs("FRAME\n", out) >= 0;
+      // Y, U then V planes, BT.601 studio range
+      for (int plane = 0; plane < 3 && ok; ++plane) {
+	for (int y = h - 1; y >= 0 && ok; --y) {
+	  const uint8_t* p = &f.pixels[4 * w * y];
+	  for (int x = 0; x < w; ++x, p += 4) {
+	    int r = p[0], g = p[1], b = p[2];
+	    int v;
+	    if (plane == 0) v = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	    else if (plane == 1) v = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+	    else v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	    row[x] = (uint8_t)v;
+	  }
+	  ok = fwrite(row.data(), w, 1, out) == 1;
+	}
+      }
+    }
+    if (!ok) {
+      // The reader went away or the disk is full, stop writing
+      rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Capture to %s failed, stopping", settings.command.empty() ? settings.path.c_str() : settings.command.c_str());
+      closeOutput();
+      dropped.fetch_add(f.repeat - n, std::memory_order_relaxed);
+      return;
+    }
+    written.fetch_add(1, std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,115 @@
+#pragma once
+#ifndef FRAME_CAPTURE_HPP
+#define FRAME_CAPTURE_HPP
+
+#include "GLFW/glfw3.h"
+#include "RingBuffer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CaptureSettings {
+  enum Format {
+    RAW_RGBA, // Bare RGBA8 frames, top row first
+    Y4M // YUV4MPEG2, 4:4:4, readable by ffmpeg and most encoders
+  };
+
+  std::string path; // File or named pipe to write to
+  // If set, a shell command (e.g. an encoder) that frames are piped
+  // to instead of being written to path
+  std::string command;
+  Format format = Y4M;
+  int width = 1280;
+  int height = 720;
+  float fps = 30;
+  // Wait for the GPU and the writer rather than drop frames. Only for
+  // offline rendering, where nobody is watching the clock.
+  bool lossless = false;
+};
+
+// FrameCapture streams a renderer's frames to a file or pipe, at its
+// own resolution and frame rate. The render thread scales each due
+// frame into an offscreen target and reads it into a ring of pixel
+// buffer objects without waiting; finished reads are collected on
+// later frames and handed through a lock-free queue to a writer
+// thread, which does the conversion and the (possibly blocking) I/O.
+//
+// Output timing follows the time passed to captureFrame(), not the
+// render rate: frames are repeated when rendering is slower than the
+// capture rate and skipped when it is faster.
+class FrameCapture {
+public:
+  explicit FrameCapture(CaptureSettings const& s);
+  // Flushes queued frames and closes the output, which blocks until
+  // the writer is done. Must be preceded by releaseGL() on the render
+  // thread.
+  ~FrameCapture();
+
+  // Lets go of c without waiting for its writer: if that was the last
+  // reference, the capture is destroyed on a thread of its own. For
+  // threads that must not block on I/O. Must be preceded by
+  // releaseGL().
+  static void dispose(std::shared_ptr<FrameCapture> c);
+
+  // Captures the frame in srcFramebuffer, of size srcWidth by
+  // srcHeight, if one is due at time (in seconds), and collects
+  // finished reads. Render thread only, with the renderer's context
+  // current.
+  void captureFrame(double time, GLuint srcFramebuffer, int srcWidth, int srcHeight);
+
+  // Frees the GL objects. Render thread only, with the context that
+  // captured frames current.
+  void releaseGL();
+
+  CaptureSettings const& getSettings() const { return settings; }
+  uint64_t framesWritten() const { return written.load(std::memory_order_relaxed); }
+  // Frames lost because the GPU or the writer fell behind
+  uint64_t framesDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+  struct Frame {
+    std::vector<uint8_t> pixels; // RGBA8, bottom row first
+    int repeat; // Number of output frames this one stands for
+  };
+
+  static const int kPixelBuffers = 3;
+  static const size_t kPoolFrames = 8;
+
+  // Render thread only
+  bool glReady = false;
+  GLuint framebuffer = 0, renderbuffer = 0;
+  GLuint pixelBuffers[kPixelBuffers];
+  GLsync fences[kPixelBuffers];
+  int repeats[kPixelBuffers];
+  int nextBuffer = 0;
+  bool started = false;
+  double startTime = 0;
+  uint64_t framesDue = 0; // Output frames accounted for since startTime
+  void initGL();
+  void collect(bool wait);
+
+  // Filled frames go to the writer, which returns them when written
+  SPSCRingBuffer<Frame*, 16> filled;
+  SPSCRingBuffer<Frame*, 16> recycled;
+  Frame pool[kPoolFrames];
+
+  // Writer thread
+  std::thread writer;
+  std::atomic<bool> quit;
+  FILE* out = nullptr;
+  std::vector<uint8_t> row;
+  FILE* openOutput();
+  void closeOutput();
+  void run();
+  void write(Frame const& f);
+
+  CaptureSettings settings;
+  std::atomic<uint64_t> written;
+  std::atomic<uint64_t> dropped;
+};
+
+#endif
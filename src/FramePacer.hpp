@@ -0,0 +1,69 @@
+#pragma once
+#ifndef FRAME_PACER_HPP
+#define FRAME_PACER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// FramePacer schedules frames against a monotonic clock. Deadlines
+// advance by exactly one period per frame so the rate doesn't drift
+// with the cost of each frame. When a frame overruns by more than a
+// whole period, the missed frames are skipped rather than rendered
+// back to back, so a slow preset degrades to a lower rate instead of
+// monopolizing the thread.
+class FramePacer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  FramePacer() : skipped(0) {
+    setTargetFPS(60);
+    deadline = Clock::now();
+  }
+
+  void setTargetFPS(float fps) {
+    if (fps <= 0) fps = 1;
+    fps_ = fps;
+    period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+  }
+
+  float targetFPS() const { return fps_; }
+
+  // Restarts the schedule from now, e.g. after a pause.
+  void reset() {
+    deadline = Clock::now();
+  }
+
+  // Marks the end of a frame and returns when the next one is due.
+  Clock::time_point frameDone(Clock::time_point now) {
+    deadline += period;
+    if (now - deadline > period) {
+      Clock::duration::rep missed = (now - deadline) / period;
+      deadline += period * missed;
+      skipped.fetch_add(missed, std::memory_order_relaxed);
+    }
+    return deadline;
+  }
+
+  // Pushes the next deadline back, to charge a frame for going over
+  // its share of a render thread.
+  Clock::time_point postpone(Clock::duration d) {
+    deadline += d;
+    return deadline;
+  }
+
+  // Period between two frames at the target frame rate.
+  Clock::duration framePeriod() const { return period; }
+
+  // Number of frames dropped so far to catch up with the schedule.
+  // Safe to call from any thread.
+  uint64_t skippedFrames() const { return skipped.load(std::memory_order_relaxed); }
+
+private:
+  float fps_;
+  Clock::duration period;
+  Clock::time_point deadline;
+  std::atomic<uint64_t> skipped;
+};
+
+#endif
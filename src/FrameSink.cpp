@@ -0,0 +1,209 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "FrameSink.hpp"
+#include "Renderer.hpp"
+#include "GLFW/glfw3.h"
+#include "glfwUtils.hpp"
+#include "util/common.hpp"
+#include <algorithm>
+#include <vector>
+
+FrameSink::FrameSink(ProjectMRenderer* owner, int index) : owner(owner), closed(false), framebufferWidth(0), framebufferHeight(0) {
+  glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+  glfwWindowHint(GLFW_MAXIMIZED, GLFW_FALSE);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+  window = glfwCreateWindow(480, 480, "", NULL, rack::gWindow);
+  if (!window) {
+    rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Could not create an output window.");
+    return;
+  }
+  glfwSetWindowTitle(window, u8"Milkrack");
+
+  // Monitors other than Rack's, or Rack's if there's only one
+  GLFWmonitor* rackMonitor = rack::gWindow ? glfwWindowGetNearestMonitor(rack::gWindow) : nullptr;
+  int count;
+  GLFWmonitor** monitors = glfwGetMonitors(&count);
+  std::vector<GLFWmonitor*> others;
+  for (int i = 0; i < count; ++i) {
+    if (monitors[i] != rackMonitor) others.push_back(monitors[i]);
+  }
+  if (others.empty() && rackMonitor) others.push_back(rackMonitor);
+  if (!others.empty()) {
+    int n = others.size();
+    int x, y;
+    glfwGetMonitorPos(others[index % n], &x, &y);
+    // Cascaded when there are more outputs than monitors
+    int offset = 40 * (1 + index / n);
+    glfwSetWindowPos(window, x + offset, y + offset);
+  }
+
+  int x, y;
+  glfwGetFramebufferSize(window, &x, &y);
+  framebufferWidth.store(x);
+  framebufferHeight.store(y);
+  glfwSetWindowUserPointer(window, reinterpret_cast<void*>(this));
+  glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+  glfwSetKeyCallback(window, keyCallback);
+  thread = std::thread([this](){ this->run(); });
+}
+
+FrameSink::~FrameSink() {
+  close();
+}
+
+bool FrameSink::closeRequested() const {
+  return window && glfwWindowShouldClose(window);
+}
+
+bool FrameSink::isVisible() const {
+  return window && !glfwGetWindowAttrib(window, GLFW_ICONIFIED);
+}
+
+void FrameSink::close() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    closed.store(true);
+  }
+  wake.notify_one();
+  if (thread.joinable()) thread.join();
+  // The context is no longer current anywhere
+  if (window) glfwDestroyWindow(window);
+  window = nullptr;
+}
+
+void FrameSink::copyFrame(GLuint srcFramebuffer, GLuint drawFramebuffer, int srcWidth, int srcHeight) {
+  int slot = frames.writeSlot();
+  if (!textures[slot]) glGenTextures(1, &textures[slot]);
+  if (widths[slot] != srcWidth || heights[slot] != srcHeight) {
+    // Only the writer's slot, the window may be reading the others
+    glBindTexture(GL_TEXTURE_2D, textures[slot]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, srcWidth, srcHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    widths[slot] = srcWidth;
+    heights[slot] = srcHeight;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, srcFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+  glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[slot], 0);
+  glBlitFramebuffer(0, 0, srcWidth, srcHeight, 0, 0, srcWidth, srcHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void FrameSink::publish() {
+  int slot = frames.writeSlot();
+  if (fences[slot]) glDeleteSync(fences[slot]);
+  fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+  frames.publish();
+  requestPresent();
+}
+
+void FrameSink::releaseGL() {
+  for (int i = 0; i < kFrameSlots; ++i) {
+    if (textures[i]) glDeleteTextures(1, &textures[i]);
+    textures[i] = 0;
+    widths[i] = heights[i] = 0;
+    if (fences[i]) glDeleteSync(fences[i]);
+    fences[i] = nullptr;
+  }
+}
+
+void FrameSink::requestPresent() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    pending = true;
+  }
+  wake.notify_one();
+}
+
+void FrameSink::run() {
+  glfwMakeContextCurrent(window);
+  // Swaps wait for the refresh of the monitor the window is on
+  glfwSwapInterval(1);
+  GLuint framebuffer;
+  glGenFramebuffers(1, &framebuffer);
+  bool hasFrame = false;
+
+  std::unique_lock<std::mutex> l(m);
+  while (true) {
+    wake.wait(l, [this](){ return pending || closed.load(); });
+    if (closed.load()) break;
+    pending = false;
+    l.unlock();
+
+    if (frames.acquire()) {
+      hasFrame = true;
+      glWaitSync(fences[frames.readSlot()], 0, GL_TIMEOUT_IGNORED);
+    }
+    int w = framebufferWidth.load();
+    int h = framebufferHeight.load();
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glViewport(0, 0, w, h);
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+    int slot = frames.readSlot();
+    if (hasFrame && w > 0 && h > 0) {
+      // Scaled to fit, keeping the aspect ratio
+      int sw = widths[slot], sh = heights[slot];
+      float scale = std::min((float)w / sw, (float)h / sh);
+      int dw = (int)(sw * scale), dh = (int)(sh * scale);
+      int dx = (w - dw) / 2, dy = (h - dh) / 2;
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+      glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[slot], 0);
+      glBlitFramebuffer(0, 0, sw, sh, dx, dy, dx + dw, dy + dh, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    }
+    glfwSwapBuffers(window);
+    l.lock();
+  }
+  l.unlock();
+
+  glDeleteFramebuffers(1, &framebuffer);
+  glfwMakeContextCurrent(nullptr);
+}
+
+void FrameSink::framebufferSizeCallback(GLFWwindow* win, int x, int y) {
+  FrameSink* s = reinterpret_cast<FrameSink*>(glfwGetWindowUserPointer(win));
+  s->framebufferWidth.store(x);
+  s->framebufferHeight.store(y);
+  s->requestPresent();
+}
+
+void FrameSink::keyCallback(GLFWwindow* win, int key, int scancode, int action, int mods) {
+  FrameSink* s = reinterpret_cast<FrameSink*>(glfwGetWindowUserPointer(win));
+  if (action != GLFW_PRESS) return;
+  switch (key) {
+  case GLFW_KEY_F:
+  case GLFW_KEY_F4:
+  case GLFW_KEY_ENTER:
+    if (!glfwGetWindowMonitor(win)) {
+      GLFWmonitor* monitor = glfwWindowGetNearestMonitor(win);
+      if (!monitor) break;
+      const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+      glfwGetWindowPos(win, &s->lastX, &s->lastY);
+      glfwGetWindowSize(win, &s->lastWidth, &s->lastHeight);
+      glfwSetWindowMonitor(win, monitor, 0, 0, mode->width, mode->height, mode->refreshRate);
+    } else {
+      glfwSetWindowMonitor(win, nullptr, s->lastX, s->lastY, s->lastWidth, s->lastHeight, GLFW_DONT_CARE);
+    }
+    break;
+  case GLFW_KEY_ESCAPE:
+  case GLFW_KEY_Q:
+    if (!glfwGetWindowMonitor(win)) {
+      glfwIconifyWindow(win);
+    } else {
+      glfwSetWindowMonitor(win, nullptr, s->lastX, s->lastY, s->lastWidth, s->lastHeight, GLFW_DONT_CARE);
+    }
+    break;
+  case GLFW_KEY_R:
+    s->owner->requestPresetID(kPresetIDRandom);
+    break;
+  default:
+    break;
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+#ifndef FRAME_SINK_HPP
+#define FRAME_SINK_HPP
+
+#include "GLFW/glfw3.h"
+#include "TripleBuffer.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class ProjectMRenderer;
+
+// FrameSink shows a TextureRenderer's frames in a window of its own,
+// so that one renderer can drive any number of outputs. The render
+// thread copies each finished frame into the sink's textures, which
+// are shared with the window through rack::gWindow's share group. The
+// sink's own thread scales the latest one to the window and swaps,
+// synced to the refresh rate of the monitor the window is on; frames
+// it's too slow for are skipped.
+//
+// The window reacts to the same keys as the windowed flavor's.
+class FrameSink {
+public:
+  // Opens the window. The index'th sink of a renderer opens on the
+  // index'th monitor that Rack's window isn't on, wrapping around, so
+  // each output is ready to go full screen on its own monitor. Main
+  // thread only.
+  FrameSink(ProjectMRenderer* owner, int index);
+  // Closes the sink if it's still open, so it must then run on the
+  // main thread. Must be preceded by releaseGL() if the render thread
+  // copied any frame.
+  ~FrameSink();
+
+  // False if the window could not be created
+  bool isOpen() const { return window != nullptr; }
+  // True if the user asked to close the window. Main thread only.
+  bool closeRequested() const;
+  // True unless the window is minimized. Main thread only.
+  bool isVisible() const;
+  // Stops presenting and destroys the window. The render thread drops
+  // the sink on its next frame. Main thread only.
+  void close();
+  bool isClosed() const { return closed.load(); }
+  // Size of the window's framebuffer. Any thread.
+  void getFramebufferSize(int* x, int* y) const {
+    *x = framebufferWidth.load();
+    *y = framebufferHeight.load();
+  }
+
+  // Copies the frame in srcFramebuffer, of size srcWidth by srcHeight,
+  // into a free slot, through drawFramebuffer. Render thread only.
+  void copyFrame(GLuint srcFramebuffer, GLuint drawFramebuffer, int srcWidth, int srcHeight);
+  // Hands the last copied frame to the window, which waits for the GPU
+  // to finish the copy before showing it. Render thread only.
+  void publish();
+  // Frees the textures. Render thread only.
+  void releaseGL();
+
+private:
+  static const int kFrameSlots = 3;
+
+  ProjectMRenderer* owner;
+  GLFWwindow* window = nullptr;
+  // Window geometry to go back to when leaving full screen
+  int lastX = 0, lastY = 0, lastWidth = 0, lastHeight = 0;
+
+  // Written by the render thread, read by the present thread
+  GLuint textures[kFrameSlots] = {0};
+  int widths[kFrameSlots] = {0}, heights[kFrameSlots] = {0};
+  GLsync fences[kFrameSlots] = {0};
+  TripleBuffer frames;
+
+  std::thread thread;
+  std::mutex m;
+  std::condition_variable wake;
+  bool pending = false; // Something to present
+  std::atomic<bool> closed;
+  std::atomic<int> framebufferWidth, framebufferHeight;
+
+  // The present thread
+  void run();
+  void requestPresent();
+  static void framebufferSizeCallback(GLFWwindow* win, int x, int y);
+  static void keyCallback(GLFWwindow* win, int key, int scancode, int action, int mods);
+};
+
+#endif
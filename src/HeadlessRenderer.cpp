@@ -0,0 +1,134 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "HeadlessRenderer.hpp"
+#include "util/common.hpp"
+#include <EGL/eglext.h>
+#include <cstring>
+#include <mutex>
+
+// All headless renderers share one EGL display. eglTerminate() isn't
+// reference counted, so we count users ourselves.
+static std::mutex display_m;
+static EGLDisplay sharedDisplay = EGL_NO_DISPLAY;
+static int displayUsers = 0;
+
+EGLDisplay HeadlessRenderer::acquireDisplay() {
+  std::lock_guard<std::mutex> l(display_m);
+  if (displayUsers++) return sharedDisplay;
+
+  EGLDisplay d = EGL_NO_DISPLAY;
+  const char* ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (ext && strstr(ext, "EGL_MESA_platform_surfaceless")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (getPlatformDisplay) {
+      d = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+  }
+  if (d == EGL_NO_DISPLAY) {
+    d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  if (d == EGL_NO_DISPLAY || !eglInitialize(d, nullptr, nullptr)) {
+    rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Could not initialize an EGL display (error 0x%x)", eglGetError());
+    displayUsers = 0;
+    return EGL_NO_DISPLAY;
+  }
+  sharedDisplay = d;
+  return sharedDisplay;
+}
+
+void HeadlessRenderer::releaseDisplay() {
+  std::lock_guard<std::mutex> l(display_m);
+  if (--displayUsers == 0) {
+    eglTerminate(sharedDisplay);
+    sharedDisplay = EGL_NO_DISPLAY;
+  }
+}
+
+bool HeadlessRenderer::createContext() {
+  width = settings.windowWidth;
+  height = settings.windowHeight;
+  display = acquireDisplay();
+  if (display == EGL_NO_DISPLAY) return false;
+
+  const EGLint configAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_ALPHA_SIZE, 8,
+    EGL_NONE
+  };
+  const EGLint surfaceAttribs[] = {
+    EGL_WIDTH, width,
+    EGL_HEIGHT, height,
+    EGL_NONE
+  };
+  // Same context flavor as the GLFW renderers ask for
+  const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+    EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+    EGL_NONE
+  };
+
+  EGLConfig config;
+  EGLint nconfigs = 0;
+  if (!eglBindAPI(EGL_OPENGL_API) ||
+      !eglChooseConfig(display, configAttribs, &config, 1, &nconfigs) || nconfigs < 1 ||
+      (surface = eglCreatePbufferSurface(display, config, surfaceAttribs)) == EGL_NO_SURFACE ||
+      (context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs)) == EGL_NO_CONTEXT) {
+    rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Could not create a headless EGL context (error 0x%x)", eglGetError());
+    destroyContext();
+    return false;
+  }
+
+  for (int i = 0; i < kFrameSlots; ++i) {
+    frameData[i].resize(4 * width * height);
+  }
+  return true;
+}
+
+void HeadlessRenderer::destroyContext() {
+  if (display == EGL_NO_DISPLAY) return;
+  if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+  if (surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+  context = EGL_NO_CONTEXT;
+  surface = EGL_NO_SURFACE;
+  display = EGL_NO_DISPLAY;
+  releaseDisplay();
+}
+
+void HeadlessRenderer::makeContextCurrent() {
+  eglBindAPI(EGL_OPENGL_API);
+  eglMakeCurrent(display, surface, surface, context);
+}
+
+void HeadlessRenderer::releaseContext() {
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+void HeadlessRenderer::getFramebufferSize(int* x, int* y) {
+  *x = width;
+  *y = height;
+}
+
+void HeadlessRenderer::extraProjectMFrameRendered() {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frameData[frames.writeSlot()].data());
+  frames.publish();
+}
+
+int HeadlessRenderer::acquireLatestFrame() {
+  if (frames.acquire()) {
+    hasFrame = true;
+  }
+  return hasFrame ? frames.readSlot() : -1;
+}
+
+const std::vector<uint8_t>& HeadlessRenderer::getFrame(int slot) const {
+  return frameData[slot];
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef HEADLESS_RENDERER_HPP
+#define HEADLESS_RENDERER_HPP
+
+#include "Renderer.hpp"
+#include "TripleBuffer.hpp"
+#include <EGL/egl.h>
+#include <cstdint>
+#include <vector>
+
+// HeadlessRenderer renders without a display or a window system: it
+// creates an EGL context on Mesa's surfaceless platform (or the
+// default display if that isn't available) with a pbuffer as its
+// framebuffer, which works under llvmpipe on machines without a GPU.
+// Every finished frame is read back into CPU memory.
+//
+// projectM always draws its final pass to framebuffer 0, so the
+// pbuffer is what stands in for a window's back buffer. Frames are
+// the size given by the settings' windowWidth and windowHeight.
+class HeadlessRenderer : public ProjectMRenderer {
+public:
+  static const int kFrameSlots = 3;
+
+  virtual ~HeadlessRenderer() { shutdown(); }
+
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+
+  // Latches the most recently completed frame and returns the slot
+  // holding it, or -1 if no frame has been completed yet. The slot
+  // stays untouched by the render thread until the next call. Only
+  // one thread may read frames.
+  int acquireLatestFrame();
+
+  // Pixels of the frame in the given slot: width * height RGBA8
+  // values, bottom row first.
+  const std::vector<uint8_t>& getFrame(int slot) const;
+
+private:
+  int width = 0, height = 0;
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLSurface surface = EGL_NO_SURFACE;
+  EGLContext context = EGL_NO_CONTEXT;
+
+  std::vector<uint8_t> frameData[kFrameSlots];
+  TripleBuffer frames;
+  bool hasFrame = false; // Reader only
+
+  bool createContext() override;
+  void destroyContext() override;
+  const void* contextHandle() const override { return context == EGL_NO_CONTEXT ? nullptr : context; }
+  void makeContextCurrent() override;
+  void releaseContext() override;
+  void setSwapInterval(int interval) override {}
+  void getFramebufferSize(int* x, int* y) override;
+  void swapBuffers() override {}
+  void extraProjectMFrameRendered() override;
+
+  static EGLDisplay acquireDisplay();
+  static void releaseDisplay();
+};
+
+#endif
@@ -0,0 +1,97 @@
+#pragma once
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Histogram counts non-negative integer values (typically durations in
+// microseconds) into log-linear buckets, in the manner of
+// HdrHistogram: values below 32 are exact, and each power of two above
+// that is split in 16 buckets, so every recorded value is known to
+// within about 6%. Values up to 2^32 fit.
+//
+// It has a single writer. Readers on other threads may look at it at
+// any time and see a consistent enough picture, since every field is
+// a relaxed atomic.
+class Histogram {
+public:
+  static const int kSubBits = 4;
+  static const int kSubBuckets = 1 << kSubBits; // Per power of two
+  static const int kLinear = 2 * kSubBuckets; // Exact values below this
+  static const int kBuckets = kLinear + (32 - kSubBits - 1) * kSubBuckets;
+
+  Histogram() { reset(); }
+
+  // Writer only
+  void record(uint64_t v) {
+    if (v > 0xffffffffu) v = 0xffffffffu;
+    bump(buckets[bucketOf(v)], 1);
+    bump(n, 1);
+    bump(sum, v);
+    if (v > max_.load(std::memory_order_relaxed)) max_.store(v, std::memory_order_relaxed);
+  }
+
+  // Writer only, or while the writer is known to be idle
+  void reset() {
+    for (int i = 0; i < kBuckets; ++i) buckets[i].store(0, std::memory_order_relaxed);
+    n.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t count() const { return n.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  double mean() const {
+    uint64_t c = count();
+    return c ? (double)sum.load(std::memory_order_relaxed) / c : 0;
+  }
+
+  // Smallest value such that at least p (between 0 and 1) of the
+  // recorded values are at or below it, to within a bucket. 0 if
+  // nothing was recorded.
+  uint64_t percentile(double p) const {
+    uint64_t c = count();
+    if (!c) return 0;
+    uint64_t want = (uint64_t)(p * c + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += buckets[i].load(std::memory_order_relaxed);
+      if (seen >= want) {
+	uint64_t top = bucketTop(i);
+	return top < max() ? top : max();
+      }
+    }
+    return max();
+  }
+
+private:
+  static int bucketOf(uint64_t v) {
+    if (v < (uint64_t)kLinear) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - kSubBits;
+    return kLinear + (shift - 1) * kSubBuckets + (int)(v >> shift) - kSubBuckets;
+  }
+
+  // Largest value that lands in bucket i
+  static uint64_t bucketTop(int i) {
+    if (i < kLinear) return i;
+    int shift = (i - kLinear) / kSubBuckets + 1;
+    uint64_t sub = (i - kLinear) % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  // Single writer, no need for a locked read-modify-write
+  static void bump(std::atomic<uint64_t>& a, uint64_t d) {
+    a.store(a.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> buckets[kBuckets];
+  std::atomic<uint64_t> n;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max_;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+
+// Fixed-capacity multi-producer/single-consumer queue. Any number of
+// threads may push, exactly one may pop. Nobody takes a lock or
+// allocates, and a producer never waits on the consumer. Each cell
+// carries a sequence number telling whose turn it is (Vyukov's
+// bounded queue), so producers only contend on the head counter.
+template<typename T, size_t N>
+class MPSCQueue {
+  static_assert(N && (N & (N - 1)) == 0, "MPSCQueue capacity must be a power of two");
+
+public:
+  MPSCQueue() : head(0), tail(0) {
+    for (size_t i = 0; i < N; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  static constexpr size_t capacity() { return N; }
+
+  // Appends v. Returns false, leaving the queue untouched, if it is
+  // full. Any thread.
+  bool push(T const& v) {
+    size_t h = head.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& c = cells[h & (N - 1)];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      ptrdiff_t d = (ptrdiff_t)(seq - h);
+      if (d == 0) {
+	if (head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) {
+	  c.value = v;
+	  c.seq.store(h + 1, std::memory_order_release);
+	  return true;
+	}
+      } else if (d < 0) {
+	return false; // The consumer hasn't freed this cell yet
+      } else {
+	h = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Takes the oldest element into out. Returns false if there is
+  // none, or if the producer that claimed it hasn't finished writing
+  // it yet. Consumer only.
+  bool pop(T* out) {
+    Cell& c = cells[tail & (N - 1)];
+    if (c.seq.load(std::memory_order_acquire) != tail + 1) {
+      return false;
+    }
+    *out = c.value;
+    c.seq.store(tail + N, std::memory_order_release);
+    ++tail;
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  std::atomic<size_t> head;
+  char pad0[64 - sizeof(std::atomic<size_t>)];
+  size_t tail; // Consumer only
+  char pad1[64 - sizeof(size_t)];
+  Cell cells[N];
+};
+
+#endif
@@ -1,4 +1,8 @@
 #include "Milkrack.hpp"
+#include "ShaderCache.hpp"
+#include "TextureCache.hpp"
+#include "PresetCosts.hpp"
+#include "PresetCatalog.hpp"
 
 Plugin *plugin;
 
@@ -11,6 +15,21 @@ void init(Plugin *p) {
 	p->addModel(modelWindowedMilkrackModule);
 	p->addModel(modelEmbeddedMilkrackModule);
 
+	// Compiled shader programs are kept across sessions
+	systemCreateDirectory(assetLocal("Milkrack"));
+	systemCreateDirectory(assetLocal("Milkrack/shaders"));
+	ShaderCache::get().setMemoryBudget(32 << 20);
+	ShaderCache::get().setDiskBudget(128 << 20);
+	ShaderCache::get().setDirectory(assetLocal("Milkrack/shaders"));
+	// So are preset catalogs
+	PresetCatalog::setCacheDirectory(assetLocal("Milkrack"));
+	// Textures of presets no instance shows anymore, kept for when one
+	// comes back
+	TextureCache::get().setBudget(256 << 20);
+
+	// Measured by milkrack-bench, see `make preset-costs`
+	PresetCosts::get().load(assetPlugin(plugin, "res/preset_costs.json"));
+
 	// Any other plugin initialization may go here.
 	// As an alternative, consider lazy-loading assets and lookup tables when your module is created to reduce startup times of Rack.
 }
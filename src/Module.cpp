@@ -6,10 +6,15 @@
 #include "nanovg_gl.h"
 #include "deps/projectm/src/libprojectM/projectM.hpp"
 #include "Renderer.hpp"
+#include "RenderService.hpp"
+#include "PCMBuffer.hpp"
+#include "PCMIngestor.hpp"
+#include "PresetCatalog.hpp"
 
+#include <algorithm>
+#include <memory>
 #include <thread>
-
-static const unsigned int kSampleWindow = 512;
+#include <vector>
 
 struct MilkrackModule : Module {
   enum ParamIds {
@@ -22,68 +27,219 @@ struct MilkrackModule : Module {
     NUM_INPUTS
   };
   enum OutputIds {
+    BEAT_OUTPUT,
+    BASS_OUTPUT, MID_OUTPUT, TREBLE_OUTPUT,
     NUM_OUTPUTS
   };
   enum LightIds {
     NUM_LIGHTS
   };
 
-  MilkrackModule() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS) {}
+  MilkrackModule() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS), pcm(std::make_shared<PCMBuffer>()), ingestor(pcm.get(), &analyzer) {
+    capture.path = assetLocal("Milkrack/capture.y4m");
+    ingestor.setSampleRate(engineGetSampleRate());
+  }
 
-  unsigned int i = 0;
-  bool full = false;
   bool nextPreset = false;
   SchmittTrigger nextPresetTrig;
-  float pcm_data[kSampleWindow];
+  // Frame pacing, saved in the patch and applied by the widget
+  float targetFPS = 60;
+  bool vsync = false;
+  // Lower the resolution rather than drop frames, saved in the patch
+  // and applied by the widget
+  bool dynamicResolution = true;
+  // projectM quality tier, saved in the patch and applied by the widget
+  Quality quality = QUALITY_AUTO;
+  // Video capture, saved in the patch and applied by the widget
+  CaptureSettings capture;
+  bool captureEnabled = false;
+  // Output windows showing the embedded flavor's frames, saved in the
+  // patch and applied by the widget
+  int outputWindows = 0;
+  // Shared with the renderer, which may outlive the module briefly
+  // while its render thread winds down.
+  std::shared_ptr<PCMBuffer> pcm;
+  // Beats and band levels of the input, for the outputs
+  AudioAnalyzer analyzer;
+  uint32_t beatsSeen = 0;
+  PulseGenerator beatPulse;
+  // Feeds pcm and analyzer from step()
+  PCMIngestor ingestor;
 
   void step() override {
-    pcm_data[i++] = inputs[LEFT_INPUT].value;
-    if (inputs[RIGHT_INPUT].active)
-      pcm_data[i++] = inputs[RIGHT_INPUT].value;
-    else
-      pcm_data[i++] = inputs[LEFT_INPUT].value;
-    if (i >= kSampleWindow) {
-      i = 0;
-      full = true;
+    float l = inputs[LEFT_INPUT].value;
+    float r = inputs[RIGHT_INPUT].active ? inputs[RIGHT_INPUT].value : l;
+    ingestor.push(l, r);
+
+    if (analyzer.beatCount() != beatsSeen) {
+      beatsSeen = analyzer.beatCount();
+      beatPulse.trigger(1e-3f);
     }
+    outputs[BEAT_OUTPUT].value = beatPulse.process(engineGetSampleTime()) ? 10.f : 0.f;
+    // Average loudness is 2.5V, four times that is full scale
+    outputs[BASS_OUTPUT].value = clamp(2.5f * analyzer.level(AudioAnalyzer::BASS), 0.f, 10.f);
+    outputs[MID_OUTPUT].value = clamp(2.5f * analyzer.level(AudioAnalyzer::MID), 0.f, 10.f);
+    outputs[TREBLE_OUTPUT].value = clamp(2.5f * analyzer.level(AudioAnalyzer::TREBLE), 0.f, 10.f);
     if (nextPresetTrig.process(params[NEXT_PRESET_PARAM].value + inputs[NEXT_PRESET_INPUT].value)) {
       nextPreset = true;
     }
   }
+
+  void onSampleRateChange() override {
+    ingestor.setSampleRate(engineGetSampleRate());
+  }
+
+  json_t* toJson() override {
+    json_t* rootJ = json_object();
+    json_object_set_new(rootJ, "targetFPS", json_real(targetFPS));
+    json_object_set_new(rootJ, "vsync", json_boolean(vsync));
+    json_object_set_new(rootJ, "dynamicResolution", json_boolean(dynamicResolution));
+    json_object_set_new(rootJ, "quality", json_string(qualityName(quality)));
+    json_t* captureJ = json_object();
+    json_object_set_new(captureJ, "enabled", json_boolean(captureEnabled));
+    json_object_set_new(captureJ, "path", json_string(capture.path.c_str()));
+    json_object_set_new(captureJ, "format", json_string(capture.format == CaptureSettings::RAW_RGBA ? "rgba" : "y4m"));
+    json_object_set_new(captureJ, "width", json_integer(capture.width));
+    json_object_set_new(captureJ, "height", json_integer(capture.height));
+    json_object_set_new(captureJ, "fps", json_real(capture.fps));
+    json_object_set_new(rootJ, "capture", captureJ);
+    json_object_set_new(rootJ, "outputWindows", json_integer(outputWindows));
+    return rootJ;
+  }
+
+  void fromJson(json_t* rootJ) override {
+    json_t* fpsJ = json_object_get(rootJ, "targetFPS");
+    if (fpsJ) targetFPS = json_number_value(fpsJ);
+    json_t* vsyncJ = json_object_get(rootJ, "vsync");
+    if (vsyncJ) vsync = json_is_true(vsyncJ);
+    json_t* dynamicResolutionJ = json_object_get(rootJ, "dynamicResolution");
+    if (dynamicResolutionJ) dynamicResolution = json_is_true(dynamicResolutionJ);
+    json_t* qualityJ = json_object_get(rootJ, "quality");
+    if (qualityJ && json_is_string(qualityJ)) quality = qualityFromName(json_string_value(qualityJ));
+    json_t* captureJ = json_object_get(rootJ, "capture");
+    if (captureJ) {
+      json_t* j;
+      if ((j = json_object_get(captureJ, "enabled"))) captureEnabled = json_is_true(j);
+      if ((j = json_object_get(captureJ, "path")) && json_is_string(j)) capture.path = json_string_value(j);
+      if ((j = json_object_get(captureJ, "format")) && json_is_string(j)) capture.format = std::string(json_string_value(j)) == "rgba" ? CaptureSettings::RAW_RGBA : CaptureSettings::Y4M;
+      if ((j = json_object_get(captureJ, "width"))) capture.width = json_integer_value(j);
+      if ((j = json_object_get(captureJ, "height"))) capture.height = json_integer_value(j);
+      if ((j = json_object_get(captureJ, "fps"))) capture.fps = json_number_value(j);
+    }
+    json_t* outputWindowsJ = json_object_get(rootJ, "outputWindows");
+    if (outputWindowsJ) outputWindows = json_integer_value(outputWindowsJ);
+  }
 };
 
 
 struct BaseProjectMWidget : FramebufferWidget {
-  const int fps = 60;
   const bool debug = true;
   const projectM::Settings s;
 
   MilkrackModule* module;
 
-  std::shared_ptr<Font> font;
+  // Font of the preset name. NanoVG fonts belong to the context they
+  // were loaded in, and drawContents() draws in the framebuffer's,
+  // not gVg, so it's loaded there by path.
+  std::string fontPath;
+
+  // Font id in vg, loaded on first use
+  int fontFor(NVGcontext* vg) {
+    int f = nvgFindFont(vg, "Milkrack");
+    if (f < 0) f = nvgCreateFont(vg, "Milkrack", fontPath.c_str());
+    return f;
+  }
+
+  // The framebuffer is redrawn only when what it shows changed, and
+  // only while it can be seen. Changes made while it's hidden or
+  // scrolled away are drawn once it's back in view.
+  bool stale = true;
+  Vec shownSize; // Size on screen at the last redraw, follows zoom
+  bool onScreen = false; // As of the last step()
+  // The state the last redraw was based on
+  std::shared_ptr<const ProjectMRenderer::State> shownState;
+
+  // FramebufferWidget only caches what its children draw, so the
+  // drawing is done by one
+  struct Contents : Widget {
+    BaseProjectMWidget* owner;
+    void draw(NVGcontext* vg) override { owner->drawContents(vg); }
+  };
 
   BaseProjectMWidget() {}
   virtual ~BaseProjectMWidget() {}
 
   void init(std::string presetURL) {
-    getRenderer()->init(initSettings(presetURL));
+    getRenderer()->setQuality(module->quality);
+    getRenderer()->init(initSettings(presetURL), module->pcm);
   }
 
   template<typename T>
-  static BaseProjectMWidget* create(Vec pos, std::string presetURL) {
+  static BaseProjectMWidget* create(Vec pos, MilkrackModule* module, std::string presetURL) {
     BaseProjectMWidget* p = new T;
     p->box.pos = pos;
+    p->module = module;
+    Contents* c = new Contents;
+    c->owner = p;
+    c->box.size = p->box.size;
+    p->addChild(c);
     p->init(presetURL);
     return p;
   }
 
   virtual ProjectMRenderer* getRenderer() = 0;
 
+  // Draws what the widget shows, into the framebuffer. Only called
+  // when it's dirty.
+  virtual void drawContents(NVGcontext* vg) = 0;
+
+  // True if what drawContents() shows changed since the last call
+  virtual bool changed() = 0;
+
+  // True if the renderer published a new State since the last call.
+  // Covers the preset name and the renderer's status.
+  bool stateChanged() {
+    std::shared_ptr<const ProjectMRenderer::State> st = getRenderer()->getState();
+    if (st == shownState) return false;
+    shownState = st;
+    return true;
+  }
+
+  // Finds where the widget is in the rack's viewport. Returns false if
+  // it's hidden, scrolled out of view, or Rack is minimized.
+  bool getScreenBox(Rect* r) {
+    if (gWindow && glfwGetWindowAttrib(gWindow, GLFW_ICONIFIED)) return false;
+    for (Widget* w = this; w; w = w->parent) {
+      if (!w->visible) return false;
+    }
+    Widget* view = gRackScene ? gRackScene->scrollWidget : nullptr;
+    Vec topLeft = getRelativeOffset(Vec(), view);
+    *r = Rect(topLeft, getRelativeOffset(box.size, view).minus(topLeft));
+    return !view || r->intersects(Rect(Vec(), view->box.size));
+  }
+
   void step() override {
-    dirty = true;
-    if (module->full) {
-      getRenderer()->addPCMData(module->pcm_data, kSampleWindow);
-      module->full = false;
+    FramebufferWidget::step();
+    stale = changed() || stale;
+    Rect screen;
+    onScreen = getScreenBox(&screen);
+    if (onScreen && (stale || !screen.size.isEqual(shownSize))) {
+      dirty = true;
+      stale = false;
+      shownSize = screen.size;
+    }
+
+    RenderService::get().pump();
+    getRenderer()->setTargetFPS(module->targetFPS);
+    getRenderer()->setVSync(module->vsync);
+    getRenderer()->setDynamicResolution(module->dynamicResolution);
+    getRenderer()->setQuality(module->quality);
+    if (module->captureEnabled != getRenderer()->isCapturing()) {
+      if (module->captureEnabled) {
+	getRenderer()->startCapture(module->capture);
+      } else {
+	getRenderer()->stopCapture();
+      }
     }
     // If the module requests that we change the preset at random
     // (i.e. the random button was clicked), tell the render thread to
@@ -116,22 +272,30 @@ struct BaseProjectMWidget : FramebufferWidget {
 struct WindowedProjectMWidget : BaseProjectMWidget {
   WindowedRenderer* renderer;
 
-  WindowedProjectMWidget() : renderer(new WindowedRenderer) {}
+  WindowedProjectMWidget() : renderer(new WindowedRenderer) {
+    box.size = Vec(30, 340);
+  }
 
-  ~WindowedProjectMWidget() { delete renderer; }
+  // The renderer stops and goes away in the background
+  ~WindowedProjectMWidget() { renderer->retire(); }
 
   ProjectMRenderer* getRenderer() override { return renderer; }
 
-  void draw(NVGcontext* vg) override {
+  // Only the preset name is shown, frames go to the window
+  bool changed() override { return stateChanged(); }
+
+  void drawContents(NVGcontext* vg) override {
     nvgSave(vg);
     nvgBeginPath(vg);
     nvgFillColor(vg, nvgRGB(0x06, 0xbd, 0x01));
     nvgFontSize(vg, 14);
-    nvgFontFaceId(vg, font->handle);
+    nvgFontFaceId(vg, fontFor(vg));
     nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
     nvgScissor(vg, 5, 5, 20, 330);
     nvgRotate(vg, M_PI/2);
-    if (!getRenderer()->isRendering()) {
+    if (getRenderer()->isStarting()) {
+      nvgText(vg, 5, -7, "Starting...", nullptr);
+    } else if (!getRenderer()->isRendering()) {
       nvgText(vg, 5, -7, "Unable to initialize rendering. See log for details.", nullptr);
     } else {
       nvgText(vg, 5, -7, getRenderer()->activePresetName().c_str(), nullptr);
@@ -147,31 +311,121 @@ struct EmbeddedProjectMWidget : BaseProjectMWidget {
   static const int y = 360;
 
   TextureRenderer* renderer;
+  // NanoVG handles wrapping the renderer's frame textures, created on
+  // first use in imagesVg, the context drawContents() draws in, and
+  // kept for the lifetime of the widget.
+  int images[TextureRenderer::kFrameSlots];
+  NVGcontext* imagesVg = nullptr;
+  // Windows showing the same frames
+  std::vector<std::shared_ptr<FrameSink> > sinks;
+
+  EmbeddedProjectMWidget() : renderer(new TextureRenderer) {
+    box.size = Vec(x, y);
+    for (int i = 0; i < TextureRenderer::kFrameSlots; ++i) {
+      images[i] = 0;
+    }
+  }
 
-  EmbeddedProjectMWidget() : renderer(new TextureRenderer) {}
-
-  ~EmbeddedProjectMWidget() { delete renderer; }
+  ~EmbeddedProjectMWidget() {
+    for (int i = 0; i < TextureRenderer::kFrameSlots; ++i) {
+      if (images[i]) nvgDeleteImage(imagesVg, images[i]);
+    }
+    // Windows must be destroyed in the main thread
+    for (std::shared_ptr<FrameSink> const& s : sinks) {
+      s->close();
+    }
+    renderer->retire();
+  }
 
   ProjectMRenderer* getRenderer() override { return renderer; }
 
-  void draw(NVGcontext* vg) override {
-    int img = nvglCreateImageFromHandleGL2(vg, renderer->getTextureID(), x, y, 0);
-    NVGpaint imgPaint = nvgImagePattern(vg, 0, 0, x, y, 0.0f, img, 1.0f);
+  void step() override {
+    BaseProjectMWidget::step();
+    updateSinks();
+    // Frames are seen in the module and in output windows
+    bool visible = onScreen;
+    for (std::shared_ptr<FrameSink> const& s : sinks) {
+      visible = visible || s->isVisible();
+    }
+    renderer->setVisible(visible);
+  }
 
-    nvgBeginPath(vg);
-    nvgRect(vg, 0, 0, x, y);
-    nvgFillPaint(vg, imgPaint);
-    nvgFill(vg);
-    nvgClosePath(vg);
+  // Opens or closes output windows to match the module's setting
+  void updateSinks() {
+    for (size_t i = 0; i < sinks.size();) {
+      if (sinks[i]->closeRequested()) {
+	sinks[i]->close();
+	sinks.erase(sinks.begin() + i);
+	--module->outputWindows;
+      } else {
+	++i;
+      }
+    }
+    while ((int)sinks.size() > std::max(module->outputWindows, 0)) {
+      sinks.back()->close();
+      sinks.pop_back();
+    }
+    while ((int)sinks.size() < module->outputWindows) {
+      std::shared_ptr<FrameSink> s = std::make_shared<FrameSink>(renderer, sinks.size());
+      if (!s->isOpen()) {
+	module->outputWindows = sinks.size();
+	break;
+      }
+      renderer->addSink(s);
+      sinks.push_back(s);
+    }
+  }
+
+  bool changed() override {
+    // Both must be called, stateChanged() remembers what it saw
+    bool state = stateChanged();
+    return renderer->hasNewFrame() || state;
+  }
+
+  void drawContents(NVGcontext* vg) override {
+    int slot = renderer->acquireLatestFrame();
+    if (vg != imagesVg) {
+      // Handles are only valid in the context that created them
+      for (int i = 0; i < TextureRenderer::kFrameSlots; ++i) {
+	if (images[i]) nvgDeleteImage(imagesVg, images[i]);
+	images[i] = 0;
+      }
+      imagesVg = vg;
+    }
+    if (slot >= 0) {
+      if (!images[slot]) {
+	// The texture belongs to the renderer, NanoVG must not free it.
+	images[slot] = nvglCreateImageFromHandleGL2(vg, renderer->getFrameTexture(slot), x, y, NVG_IMAGE_NODELETE);
+      }
+      // Frames drawn for an output window have its shape, they're
+      // fitted in the panel
+      int fw, fh;
+      renderer->getFrameSize(slot, &fw, &fh);
+      float scale = std::min((float)x / std::max(fw, 1), (float)y / std::max(fh, 1));
+      float w = fw * scale, h = fh * scale;
+      float left = (x - w) / 2, top = (y - h) / 2;
+      NVGpaint imgPaint = nvgImagePattern(vg, left, top, w, h, 0.0f, images[slot], 1.0f);
+
+      nvgBeginPath(vg);
+      nvgRect(vg, 0, 0, x, y);
+      nvgFillColor(vg, nvgRGB(0, 0, 0));
+      nvgFill(vg);
+      nvgClosePath(vg);
+      nvgBeginPath(vg);
+      nvgRect(vg, left, top, w, h);
+      nvgFillPaint(vg, imgPaint);
+      nvgFill(vg);
+      nvgClosePath(vg);
+    }
 
     nvgSave(vg);
     nvgScissor(vg, 0, 0, x, y);
     nvgBeginPath(vg);
     nvgFillColor(vg, nvgRGB(0x06, 0xbd, 0x01));
     nvgFontSize(vg, 14);
-    nvgFontFaceId(vg, font->handle);
+    nvgFontFaceId(vg, fontFor(vg));
     nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
-    nvgText(vg, 10, 20, getRenderer()->activePresetName().c_str(), nullptr);
+    nvgText(vg, 10, 20, getRenderer()->isStarting() ? "Starting..." : getRenderer()->activePresetName().c_str(), nullptr);
     nvgFill(vg);
     nvgClosePath(vg);
     nvgRestore(vg);
@@ -179,28 +433,95 @@ struct EmbeddedProjectMWidget : BaseProjectMWidget {
 };
 
 
+// Picks a preset of the renderer's catalog
 struct SetPresetMenuItem : MenuItem {
   BaseProjectMWidget* w;
-  unsigned int presetId;
+  size_t index;
 
   void onAction(EventAction& e) override {
-    w->getRenderer()->requestPresetID(presetId);
+    w->getRenderer()->requestCatalogPreset(index);
   }
 
   void step() override {
-    rightText = (w->getRenderer()->activePreset() == presetId) ? "<<" : "";
+    // The widget keeps the state it drew, no need to ask the renderer
+    // from every item
+    std::shared_ptr<const ProjectMRenderer::State> const& st = w->shownState;
+    rightText = st && st->catalogIndex == (int)index ? "<<" : "";
     MenuItem::step();
   }
 
-  static SetPresetMenuItem* construct(std::string label, unsigned int i, BaseProjectMWidget* w) {
+  static SetPresetMenuItem* construct(std::string label, size_t i, BaseProjectMWidget* w) {
     SetPresetMenuItem* m = new SetPresetMenuItem;
     m->w = w;
-    m->presetId = i;
+    m->index = i;
     m->text = label;
     return m;
   }
 };
 
+// A page of the catalog, whose items are only created when it's
+// opened
+struct PresetPageMenuItem : MenuItem {
+  static const size_t kPageSize = 100;
+
+  BaseProjectMWidget* w;
+  std::shared_ptr<const PresetCatalog> catalog;
+  size_t first;
+
+  Menu* createChildMenu() override {
+    Menu* menu = new Menu;
+    for (size_t i = first; i < std::min(first + kPageSize, catalog->size()); ++i) {
+      menu->addChild(SetPresetMenuItem::construct(catalog->name(i), i, w));
+    }
+    return menu;
+  }
+
+  static PresetPageMenuItem* construct(std::shared_ptr<const PresetCatalog> catalog, size_t first, BaseProjectMWidget* w) {
+    PresetPageMenuItem* m = new PresetPageMenuItem;
+    m->w = w;
+    m->catalog = catalog;
+    m->first = first;
+    size_t last = std::min(first + kPageSize, catalog->size()) - 1;
+    m->text = catalog->name(first).substr(0, 20) + " ... " + catalog->name(last).substr(0, 20);
+    m->rightText = RIGHT_ARROW;
+    return m;
+  }
+};
+
+// Lists the presets whose name contains the text typed, below itself.
+// Must be the last entry of its menu.
+struct PresetSearchField : TextField {
+  static const size_t kMaxResults = 30;
+
+  BaseProjectMWidget* w;
+  std::shared_ptr<const PresetCatalog> catalog;
+  Menu* menu;
+  std::vector<SetPresetMenuItem*> results;
+
+  void onTextChange() override {
+    for (SetPresetMenuItem* item : results) {
+      menu->removeChild(item);
+      delete item;
+    }
+    results.clear();
+    if (text.empty()) return;
+    for (size_t i : catalog->search(text, kMaxResults)) {
+      results.push_back(SetPresetMenuItem::construct(catalog->name(i), i, w));
+      menu->addChild(results.back());
+    }
+  }
+
+  static PresetSearchField* construct(std::shared_ptr<const PresetCatalog> catalog, Menu* menu, BaseProjectMWidget* w) {
+    PresetSearchField* f = new PresetSearchField;
+    f->w = w;
+    f->catalog = catalog;
+    f->menu = menu;
+    f->placeholder = "Search presets";
+    f->box.size.y = BND_WIDGET_HEIGHT;
+    return f;
+  }
+};
+
 struct ToggleAutoplayMenuItem : MenuItem {
   BaseProjectMWidget* w;
 
@@ -222,6 +543,235 @@ struct ToggleAutoplayMenuItem : MenuItem {
 };
 
 
+struct SetFPSMenuItem : MenuItem {
+  MilkrackModule* m;
+  float fps;
+
+  void onAction(EventAction& e) override {
+    m->targetFPS = fps;
+  }
+
+  void step() override {
+    rightText = (m->targetFPS == fps) ? "<<" : "";
+    MenuItem::step();
+  }
+
+  static SetFPSMenuItem* construct(std::string label, float fps, MilkrackModule* m) {
+    SetFPSMenuItem* i = new SetFPSMenuItem;
+    i->m = m;
+    i->fps = fps;
+    i->text = label;
+    return i;
+  }
+};
+
+struct SetQualityMenuItem : MenuItem {
+  MilkrackModule* m;
+  BaseProjectMWidget* w;
+  Quality quality;
+
+  void onAction(EventAction& e) override {
+    m->quality = quality;
+  }
+
+  void step() override {
+    rightText = "";
+    if (m->quality == quality) {
+      rightText = "<<";
+      Quality active = w->getRenderer()->activeQuality();
+      if (quality == QUALITY_AUTO) {
+	rightText = active == QUALITY_CUSTOM ? "<< (calibrating)" : std::string("<< (") + qualityName(active) + ")";
+      }
+    }
+    MenuItem::step();
+  }
+
+  static SetQualityMenuItem* construct(std::string label, Quality quality, MilkrackModule* m, BaseProjectMWidget* w) {
+    SetQualityMenuItem* i = new SetQualityMenuItem;
+    i->m = m;
+    i->w = w;
+    i->quality = quality;
+    i->text = label;
+    return i;
+  }
+};
+
+struct ToggleVSyncMenuItem : MenuItem {
+  MilkrackModule* m;
+
+  void onAction(EventAction& e) override {
+    m->vsync = !m->vsync;
+  }
+
+  void step() override {
+    rightText = (m->vsync ? "yes" : "no");
+    MenuItem::step();
+  }
+
+  static ToggleVSyncMenuItem* construct(std::string label, MilkrackModule* m) {
+    ToggleVSyncMenuItem* i = new ToggleVSyncMenuItem;
+    i->m = m;
+    i->text = label;
+    return i;
+  }
+};
+
+struct ToggleDynamicResolutionMenuItem : MenuItem {
+  MilkrackModule* m;
+  BaseProjectMWidget* w;
+
+  void onAction(EventAction& e) override {
+    m->dynamicResolution = !m->dynamicResolution;
+  }
+
+  void step() override {
+    if (!m->dynamicResolution) {
+      rightText = "no";
+    } else {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "yes (%d%%)", (int)(w->getRenderer()->renderScale() * 100 + 0.5f));
+      rightText = buf;
+    }
+    MenuItem::step();
+  }
+
+  static ToggleDynamicResolutionMenuItem* construct(std::string label, MilkrackModule* m, BaseProjectMWidget* w) {
+    ToggleDynamicResolutionMenuItem* i = new ToggleDynamicResolutionMenuItem;
+    i->m = m;
+    i->w = w;
+    i->text = label;
+    return i;
+  }
+};
+
+struct OpenOutputWindowMenuItem : MenuItem {
+  MilkrackModule* m;
+
+  void onAction(EventAction& e) override {
+    ++m->outputWindows;
+  }
+
+  void step() override {
+    rightText = m->outputWindows ? std::to_string(m->outputWindows) + " open" : "";
+    MenuItem::step();
+  }
+
+  static OpenOutputWindowMenuItem* construct(std::string label, MilkrackModule* m) {
+    OpenOutputWindowMenuItem* i = new OpenOutputWindowMenuItem;
+    i->m = m;
+    i->text = label;
+    return i;
+  }
+};
+
+struct CloseOutputWindowsMenuItem : MenuItem {
+  MilkrackModule* m;
+
+  void onAction(EventAction& e) override {
+    m->outputWindows = 0;
+  }
+
+  static CloseOutputWindowsMenuItem* construct(std::string label, MilkrackModule* m) {
+    CloseOutputWindowsMenuItem* i = new CloseOutputWindowsMenuItem;
+    i->m = m;
+    i->text = label;
+    return i;
+  }
+};
+
+struct ToggleCaptureMenuItem : MenuItem {
+  MilkrackModule* m;
+
+  void onAction(EventAction& e) override {
+    m->captureEnabled = !m->captureEnabled;
+  }
+
+  void step() override {
+    rightText = (m->captureEnabled ? "yes" : "no");
+    MenuItem::step();
+  }
+
+  static ToggleCaptureMenuItem* construct(std::string label, MilkrackModule* m) {
+    ToggleCaptureMenuItem* i = new ToggleCaptureMenuItem;
+    i->m = m;
+    i->text = label;
+    return i;
+  }
+};
+
+// Shows a render stage's timings, kept up to date while the menu is
+// open.
+struct StageStatsMenuItem : MenuItem {
+  BaseProjectMWidget* w;
+  RenderStats::Stage stage;
+
+  void step() override {
+    Histogram const& h = w->getRenderer()->getStats().stage(stage);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f / %.2f ms", h.mean() / 1000, h.percentile(0.99) / 1000.);
+    rightText = h.count() ? buf : "-";
+    MenuItem::step();
+  }
+
+  static StageStatsMenuItem* construct(std::string label, RenderStats::Stage stage, BaseProjectMWidget* w) {
+    StageStatsMenuItem* m = new StageStatsMenuItem;
+    m->w = w;
+    m->stage = stage;
+    m->text = label;
+    return m;
+  }
+};
+
+struct PCMStatsMenuItem : MenuItem {
+  BaseProjectMWidget* w;
+
+  void step() override {
+    Histogram const& h = w->getRenderer()->getStats().getPCMFill();
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.0f / %d frames", h.mean(), (int)h.percentile(0.99));
+    rightText = h.count() ? buf : "-";
+    MenuItem::step();
+  }
+
+  static PCMStatsMenuItem* construct(std::string label, BaseProjectMWidget* w) {
+    PCMStatsMenuItem* m = new PCMStatsMenuItem;
+    m->w = w;
+    m->text = label;
+    return m;
+  }
+};
+
+struct LogStatsMenuItem : MenuItem {
+  BaseProjectMWidget* w;
+
+  void onAction(EventAction& e) override {
+    w->getRenderer()->logStats();
+  }
+
+  static LogStatsMenuItem* construct(std::string label, BaseProjectMWidget* w) {
+    LogStatsMenuItem* m = new LogStatsMenuItem;
+    m->w = w;
+    m->text = label;
+    return m;
+  }
+};
+
+struct ResetStatsMenuItem : MenuItem {
+  BaseProjectMWidget* w;
+
+  void onAction(EventAction& e) override {
+    w->getRenderer()->resetStats();
+  }
+
+  static ResetStatsMenuItem* construct(std::string label, BaseProjectMWidget* w) {
+    ResetStatsMenuItem* m = new ResetStatsMenuItem;
+    m->w = w;
+    m->text = label;
+    return m;
+  }
+};
+
+
 struct BaseMilkrackModuleWidget : ModuleWidget {
   BaseProjectMWidget* w;
 
@@ -238,13 +788,56 @@ struct BaseMilkrackModuleWidget : ModuleWidget {
     menu->addChild(construct<MenuLabel>());
     menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Options"));
     menu->addChild(ToggleAutoplayMenuItem::construct("Cycle through presets", w));
+    if (w->getRenderer()->supportsVSync()) {
+      menu->addChild(ToggleVSyncMenuItem::construct("Sync to monitor refresh", m));
+    }
+    menu->addChild(ToggleDynamicResolutionMenuItem::construct("Lower resolution under load", m, w));
+    menu->addChild(ToggleCaptureMenuItem::construct("Capture video to " + stringFilename(m->capture.path), m));
+    if (w->getRenderer()->supportsSinks()) {
+      menu->addChild(OpenOutputWindowMenuItem::construct("Open output window", m));
+      if (m->outputWindows > 0) {
+	menu->addChild(CloseOutputWindowsMenuItem::construct("Close output windows", m));
+      }
+    }
+
+    menu->addChild(construct<MenuLabel>());
+    menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Frame rate"));
+    static const float kFrameRates[] = {15, 24, 30, 60, 120};
+    for (float fps : kFrameRates) {
+      menu->addChild(SetFPSMenuItem::construct(std::to_string((int)fps) + " fps", fps, m));
+    }
+
+    menu->addChild(construct<MenuLabel>());
+    menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Quality"));
+    static const char* kQualityLabels[] = {"Low", "Medium", "High", "Ultra", "Auto"};
+    for (int q = QUALITY_LOW; q <= QUALITY_AUTO; ++q) {
+      menu->addChild(SetQualityMenuItem::construct(kQualityLabels[q - QUALITY_LOW], (Quality)q, m, w));
+    }
+
+    menu->addChild(construct<MenuLabel>());
+    menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Performance (mean / p99)"));
+    menu->addChild(StageStatsMenuItem::construct("Frame", RenderStats::FRAME, w));
+    menu->addChild(StageStatsMenuItem::construct("Render (CPU)", RenderStats::RENDER, w));
+    menu->addChild(StageStatsMenuItem::construct("Render (GPU)", RenderStats::GPU, w));
+    menu->addChild(StageStatsMenuItem::construct("Preset switch", RenderStats::PRESET_SWITCH, w));
+    menu->addChild(StageStatsMenuItem::construct("Resize", RenderStats::RESIZE, w));
+    menu->addChild(StageStatsMenuItem::construct("Swap", RenderStats::SWAP, w));
+    menu->addChild(PCMStatsMenuItem::construct("Audio buffered", w));
+    menu->addChild(LogStatsMenuItem::construct("Write stats to log", w));
+    menu->addChild(ResetStatsMenuItem::construct("Reset stats", w));
 
     menu->addChild(construct<MenuLabel>());
     menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Preset"));
-    auto presets = w->getRenderer()->listPresets();
-    for (auto p : presets) {
-      menu->addChild(SetPresetMenuItem::construct(p.second, p.first, w));
+    // From the catalog, projectM isn't involved
+    std::shared_ptr<const PresetCatalog> catalog = w->getRenderer()->getState()->catalog;
+    if (!catalog) {
+      menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Loading..."));
+      return;
     }
+    for (size_t first = 0; first < catalog->size(); first += PresetPageMenuItem::kPageSize) {
+      menu->addChild(PresetPageMenuItem::construct(catalog, first, w));
+    }
+    menu->addChild(PresetSearchField::construct(catalog, menu, w));
   }
 };
 
@@ -258,10 +851,13 @@ struct MilkrackModuleWidget : BaseMilkrackModuleWidget {
     addParam(ParamWidget::create<TL1105>(Vec(19, 150), module, MilkrackModule::NEXT_PRESET_PARAM, 0.0, 1.0, 0.0));
     addInput(Port::create<PJ301MPort>(Vec(15, 170), Port::INPUT, module, MilkrackModule::NEXT_PRESET_INPUT));
 
-    std::shared_ptr<Font> font = Font::load(assetPlugin(plugin, "res/fonts/LiberationSans/LiberationSans-Regular.ttf"));
-    w = BaseProjectMWidget::create<WindowedProjectMWidget>(Vec(50, 20), assetPlugin(plugin, "presets_projectM/"));
-    w->module = module;
-    w->font = font;
+    addOutput(Port::create<PJ301MPort>(Vec(15, 220), Port::OUTPUT, module, MilkrackModule::BEAT_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 250), Port::OUTPUT, module, MilkrackModule::BASS_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 280), Port::OUTPUT, module, MilkrackModule::MID_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 310), Port::OUTPUT, module, MilkrackModule::TREBLE_OUTPUT));
+
+    w = BaseProjectMWidget::create<WindowedProjectMWidget>(Vec(50, 20), module, assetPlugin(plugin, "presets_projectM/"));
+    w->fontPath = assetPlugin(plugin, "res/fonts/LiberationSans/LiberationSans-Regular.ttf");
     addChild(w);
   }
 };
@@ -277,10 +873,13 @@ struct EmbeddedMilkrackModuleWidget : BaseMilkrackModuleWidget {
     addParam(ParamWidget::create<TL1105>(Vec(19, 150), module, MilkrackModule::NEXT_PRESET_PARAM, 0.0, 1.0, 0.0));
     addInput(Port::create<PJ301MPort>(Vec(15, 170), Port::INPUT, module, MilkrackModule::NEXT_PRESET_INPUT));
 
-    std::shared_ptr<Font> font = Font::load(assetPlugin(plugin, "res/fonts/LiberationSans/LiberationSans-Regular.ttf"));
-    w = BaseProjectMWidget::create<EmbeddedProjectMWidget>(Vec(50, 10), assetPlugin(plugin, "presets_projectM/"));
-    w->module = module;
-    w->font = font;
+    addOutput(Port::create<PJ301MPort>(Vec(15, 220), Port::OUTPUT, module, MilkrackModule::BEAT_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 250), Port::OUTPUT, module, MilkrackModule::BASS_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 280), Port::OUTPUT, module, MilkrackModule::MID_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(15, 310), Port::OUTPUT, module, MilkrackModule::TREBLE_OUTPUT));
+
+    w = BaseProjectMWidget::create<EmbeddedProjectMWidget>(Vec(50, 10), module, assetPlugin(plugin, "presets_projectM/"));
+    w->fontPath = assetPlugin(plugin, "res/fonts/LiberationSans/LiberationSans-Regular.ttf");
     addChild(w);
   }
 };
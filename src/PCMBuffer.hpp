@@ -0,0 +1,83 @@
+#pragma once
+#ifndef PCM_BUFFER_HPP
+#define PCM_BUFFER_HPP
+
+#include "RingBuffer.hpp"
+#include <atomic>
+#include <cstdint>
+
+// One stereo sample as produced by the engine.
+struct StereoFrame {
+  float l;
+  float r;
+};
+static_assert(sizeof(StereoFrame) == 2 * sizeof(float), "StereoFrame must be two packed floats");
+
+// PCMBuffer carries audio from the engine thread (the producer,
+// MilkrackModule's PCMIngestor) straight to the render thread (the consumer,
+// ProjectMRenderer's render loop). It is wait-free on both ends. When
+// the render thread falls behind, new samples are dropped and counted
+// as overruns; when a render pass finds no new samples, it counts an
+// underrun.
+class PCMBuffer {
+public:
+  // ~85ms of audio at 48kHz, enough to ride out a preset switch.
+  // PCMIngestor keeps the rate under 80kHz.
+  static const size_t kCapacity = 4096;
+
+  PCMBuffer() : overruns(0), underruns(0), discarded(0) {}
+
+  // Engine thread only.
+  void push(float l, float r) {
+    StereoFrame f = {l, r};
+    if (!frames.push(f)) {
+      overruns.store(overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+  }
+
+  // Engine thread only.
+  void push(const StereoFrame* f, size_t n) {
+    size_t dropped = n - frames.push(f, n);
+    if (dropped) {
+      overruns.store(overruns.load(std::memory_order_relaxed) + dropped, std::memory_order_relaxed);
+    }
+  }
+
+  // Render thread only. Copies up to max of the most recent frames
+  // into out and returns how many were copied. Older frames beyond
+  // max are discarded since projectM only looks at the latest window
+  // anyway.
+  size_t pop(StereoFrame* out, size_t max) {
+    size_t avail = frames.size();
+    if (avail > max) {
+      size_t skipped = frames.skip(avail - max);
+      discarded.store(discarded.load(std::memory_order_relaxed) + skipped, std::memory_order_relaxed);
+    }
+    size_t n = frames.pop(out, max);
+    if (!n) {
+      underruns.store(underruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  size_t size() const { return frames.size(); }
+
+  // Samples dropped because the buffer was full.
+  uint64_t overrunCount() const { return overruns.load(std::memory_order_relaxed); }
+
+  // Render passes that found no new samples.
+  uint64_t underrunCount() const { return underruns.load(std::memory_order_relaxed); }
+
+  // Samples pop() skipped because more than max were waiting.
+  uint64_t discardCount() const { return discarded.load(std::memory_order_relaxed); }
+
+private:
+  SPSCRingBuffer<StereoFrame, kCapacity> frames;
+  // Each counter has a single writer, so a relaxed load+store is
+  // enough and avoids a locked read-modify-write on the audio path.
+  std::atomic<uint64_t> overruns;
+  std::atomic<uint64_t> underruns;
+  std::atomic<uint64_t> discarded;
+};
+
+#endif
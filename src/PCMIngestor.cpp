@@ -0,0 +1,89 @@
+#include "PCMIngestor.hpp"
+#include <cmath>
+#include <cstring>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Rack's audio signals swing +/-5V
+static const float kVoltsToAudio = 0.2f;
+
+static_assert(PCMIngestor::kBlockSize % PCMIngestor::kMaxFactor == 0, "Blocks must hold whole decimation periods");
+
+void PCMIngestor::setSampleRate(float rate) {
+  inputRate = rate > 0 ? rate : 44100;
+  factor = 1;
+  while (factor < kMaxFactor && inputRate / (2 * factor) >= 40000) {
+    factor *= 2;
+  }
+  taps = factor > 1 ? kTapsPerFactor * factor : 0;
+  pending = 0;
+  memset(history, 0, sizeof(history));
+  if (analyzer) analyzer->setSampleRate(outputRate());
+  if (!taps) return;
+
+  // Blackman-windowed sinc. The window's transition band is about
+  // 5.5 / taps wide, centered on the cutoff so it ends at the output
+  // Nyquist frequency.
+  double cutoff = (0.5 - 2.75 / kTapsPerFactor) / factor;
+  double h[kMaxTaps];
+  double sum = 0;
+  for (int i = 0; i < taps; ++i) {
+    double x = i - (taps - 1) / 2.;
+    double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+    double w = 0.42 - 0.5 * cos(2 * M_PI * i / (taps - 1)) + 0.08 * cos(4 * M_PI * i / (taps - 1));
+    h[i] = sinc * w;
+    sum += h[i];
+  }
+  // Unity gain at DC, with the volts to audio scaling folded in
+  for (int i = 0; i < taps; ++i) {
+    float c = h[i] / sum * kVoltsToAudio;
+    coefficients[2 * (taps - 1 - i)] = c;
+    coefficients[2 * (taps - 1 - i) + 1] = c;
+  }
+}
+
+// Filters the taps samples starting at window into one output sample
+static inline StereoFrame filter(const StereoFrame* window, const float* c, int taps) {
+  const float* x = reinterpret_cast<const float*>(window);
+  float lanes[4];
+#ifdef __SSE__
+  // Lanes hold left, right, left, right
+  __m128 acc = _mm_setzero_ps();
+  for (int k = 0; k < 2 * taps; k += 4) {
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(c + k)));
+  }
+  _mm_storeu_ps(lanes, acc);
+#else
+  lanes[0] = lanes[1] = lanes[2] = lanes[3] = 0;
+  for (int k = 0; k < 2 * taps; k += 4) {
+    for (int j = 0; j < 4; ++j) lanes[j] += x[k + j] * c[k + j];
+  }
+#endif
+  StereoFrame f = {lanes[0] + lanes[2], lanes[1] + lanes[3]};
+  return f;
+}
+
+void PCMIngestor::process() {
+  pending = 0;
+  if (factor == 1) {
+    for (int i = 0; i < kBlockSize; ++i) {
+      decimated[i].l = block[i].l * kVoltsToAudio;
+      decimated[i].r = block[i].r * kVoltsToAudio;
+    }
+    out->push(decimated, kBlockSize);
+    if (analyzer) analyzer->process(decimated, kBlockSize);
+    return;
+  }
+
+  memcpy(history + taps - 1, block, sizeof(block));
+  int n = 0;
+  // Only every factor-th output is kept, so only those are computed.
+  // The window for input i starts taps - 1 samples before it.
+  for (int i = factor - 1; i < kBlockSize; i += factor) {
+    decimated[n++] = filter(history + i, coefficients, taps);
+  }
+  memmove(history, history + kBlockSize, (taps - 1) * sizeof(StereoFrame));
+  out->push(decimated, n);
+  if (analyzer) analyzer->process(decimated, n);
+}
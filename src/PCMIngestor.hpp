@@ -0,0 +1,62 @@
+#pragma once
+#ifndef PCM_INGESTOR_HPP
+#define PCM_INGESTOR_HPP
+
+#include "PCMBuffer.hpp"
+#include "AudioAnalyzer.hpp"
+
+// PCMIngestor turns the engine's voltages into the audio projectM
+// expects: it gathers samples in blocks, scales Rack's +/-5V to
+// +/-1, and decimates high engine rates down to between 40 and 80kHz
+// with a low-pass FIR, computing only the samples it keeps. The
+// result goes to a PCMBuffer a block at a time, and to an optional
+// AudioAnalyzer.
+class PCMIngestor {
+public:
+  static const int kBlockSize = 32;
+  static const int kMaxFactor = 8; // 384kHz down to 48kHz
+
+  explicit PCMIngestor(PCMBuffer* out, AudioAnalyzer* analyzer = nullptr) : out(out), analyzer(analyzer) {
+    setSampleRate(44100);
+  }
+
+  // Picks the decimation factor for the engine's rate and designs
+  // the filter for it. Engine thread only.
+  void setSampleRate(float rate);
+
+  // Rate of the audio handed to the PCMBuffer
+  float outputRate() const { return inputRate / factor; }
+
+  // Takes one engine sample, in volts. Engine thread only.
+  void push(float l, float r) {
+    block[pending].l = l;
+    block[pending].r = r;
+    if (++pending == kBlockSize) process();
+  }
+
+private:
+  // Keeps the passband up to ~80% of the output Nyquist frequency
+  static const int kTapsPerFactor = 32;
+  static const int kMaxTaps = kTapsPerFactor * kMaxFactor;
+
+  void process();
+
+  PCMBuffer* out;
+  AudioAnalyzer* analyzer;
+  float inputRate = 44100;
+  int factor = 1;
+  int taps = 0;
+
+  StereoFrame block[kBlockSize];
+  int pending = 0;
+  StereoFrame decimated[kBlockSize];
+
+  // Coefficients in reverse, each twice for the left and right
+  // channels, so a window of interleaved samples multiplies with them
+  // lane by lane.
+  alignas(16) float coefficients[2 * kMaxTaps];
+  // The last taps - 1 samples of the previous block, then this block.
+  StereoFrame history[kMaxTaps - 1 + kBlockSize];
+};
+
+#endif
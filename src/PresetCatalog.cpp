@@ -0,0 +1,326 @@
+#include "PresetCatalog.hpp"
+#include "util/common.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static const char kFileMagic[8] = {'M', 'K', 'P', 'C', 'A', 'T', 0, 0};
+static const uint32_t kFileVersion = 1;
+
+// Catalogs by directory, for the lifetime of the process
+static std::mutex catalogsMutex;
+static std::string cacheDirectory;
+static std::map<std::string, std::shared_ptr<const PresetCatalog> > catalogs;
+// Directories tryGet() started building
+static std::set<std::string> building;
+
+// FNV-1a
+static uint64_t fnv(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+static const uint64_t kHashSeed = 14695981039346656037ULL;
+
+static bool endsWithNoCase(std::string const& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  if (s.size() < n) return false;
+  for (size_t i = 0; i < n; ++i) {
+    if (tolower((unsigned char)s[s.size() - n + i]) != suffix[i]) return false;
+  }
+  return true;
+}
+
+// A preset file found on disk
+struct ScannedPreset {
+  std::string path; // Relative to the directory
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+};
+
+// Lists the presets under dir/rel, the way projectM recognizes them
+static void scan(std::string const& dir, std::string const& rel, std::vector<ScannedPreset>* out) {
+  DIR* d = opendir((dir + "/" + rel).c_str());
+  if (!d) return;
+  while (struct dirent* e = readdir(d)) {
+    if (e->d_name[0] == '.') continue;
+    std::string path = rel.empty() ? e->d_name : rel + "/" + e->d_name;
+    struct stat st;
+    if (stat((dir + "/" + path).c_str(), &st)) continue;
+    if (S_ISDIR(st.st_mode)) {
+      scan(dir, path, out);
+    } else if (S_ISREG(st.st_mode) && (endsWithNoCase(path, ".milk") || endsWithNoCase(path, ".prjm"))) {
+      ScannedPreset p = {path, (uint64_t)st.st_size, (int64_t)st.st_mtime, 0};
+      out->push_back(p);
+    }
+  }
+  closedir(d);
+}
+
+static uint64_t hashFile(std::string const& path) {
+  static const size_t kChunk = 64 * 1024;
+  std::vector<char> buf(kChunk);
+  std::ifstream f(path, std::ios::binary);
+  uint64_t h = kHashSeed;
+  while (f.read(buf.data(), kChunk) || f.gcount()) {
+    h = fnv(h, buf.data(), f.gcount());
+  }
+  return h;
+}
+
+// Start and length of the display name in a relative path: the file
+// name without its extension
+static void nameOf(std::string const& path, uint32_t* start, uint32_t* length) {
+  size_t slash = path.rfind('/');
+  size_t begin = slash == std::string::npos ? 0 : slash + 1;
+  size_t dot = path.rfind('.');
+  size_t end = dot == std::string::npos || dot < begin ? path.size() : dot;
+  *start = begin;
+  *length = end - begin;
+}
+
+static bool lessNoCase(const char* a, size_t an, const char* b, size_t bn) {
+  for (size_t i = 0; i < an && i < bn; ++i) {
+    int ca = tolower((unsigned char)a[i]), cb = tolower((unsigned char)b[i]);
+    if (ca != cb) return ca < cb;
+  }
+  return an < bn;
+}
+
+// Lays presets out as a catalog
+static std::vector<char> serialize(std::vector<ScannedPreset> const& presets) {
+  PresetCatalog::Header h;
+  memcpy(h.magic, kFileMagic, sizeof(h.magic));
+  h.version = kFileVersion;
+  h.count = presets.size();
+  h.stringsSize = 0;
+  std::vector<PresetCatalog::Entry> entries(presets.size());
+  for (size_t i = 0; i < presets.size(); ++i) {
+    PresetCatalog::Entry& e = entries[i];
+    e.path = h.stringsSize;
+    e.pathLength = presets[i].path.size();
+    nameOf(presets[i].path, &e.name, &e.nameLength);
+    e.name += e.path;
+    e.size = presets[i].size;
+    e.mtime = presets[i].mtime;
+    e.hash = presets[i].hash;
+    h.stringsSize += e.pathLength;
+  }
+
+  std::vector<char> out(sizeof(h) + entries.size() * sizeof(PresetCatalog::Entry) + h.stringsSize);
+  char* strings = out.data() + sizeof(h) + entries.size() * sizeof(PresetCatalog::Entry);
+  for (size_t i = 0; i < presets.size(); ++i) {
+    memcpy(strings + entries[i].path, presets[i].path.data(), entries[i].pathLength);
+  }
+  std::sort(entries.begin(), entries.end(), [strings](PresetCatalog::Entry const& a, PresetCatalog::Entry const& b) {
+    if (a.nameLength == b.nameLength && !memcmp(strings + a.name, strings + b.name, a.nameLength)) {
+      return lessNoCase(strings + a.path, a.pathLength, strings + b.path, b.pathLength);
+    }
+    return lessNoCase(strings + a.name, a.nameLength, strings + b.name, b.nameLength);
+  });
+  memcpy(out.data(), &h, sizeof(h));
+  memcpy(out.data() + sizeof(h), entries.data(), entries.size() * sizeof(PresetCatalog::Entry));
+  return out;
+}
+
+static std::string cachePathFor(std::string const& dir) {
+  char name[48];
+  snprintf(name, sizeof(name), "/presets-%016llx.catalog", (unsigned long long)fnv(kHashSeed, dir.data(), dir.size()));
+  return cacheDirectory + name;
+}
+
+void PresetCatalog::setCacheDirectory(std::string const& dir) {
+  std::lock_guard<std::mutex> l(catalogsMutex);
+  cacheDirectory = dir;
+}
+
+std::shared_ptr<const PresetCatalog> PresetCatalog::tryGet(std::string const& dir) {
+  // get() holds the lock while it scans, which means it's building
+  std::unique_lock<std::mutex> l(catalogsMutex, std::try_to_lock);
+  if (!l.owns_lock()) return nullptr;
+  auto it = catalogs.find(dir);
+  if (it != catalogs.end()) return it->second;
+  if (building.insert(dir).second) {
+    std::thread([dir]() { get(dir); }).detach();
+  }
+  return nullptr;
+}
+
+std::shared_ptr<const PresetCatalog> PresetCatalog::get(std::string const& dir) {
+  std::lock_guard<std::mutex> l(catalogsMutex);
+  auto it = catalogs.find(dir);
+  if (it != catalogs.end()) return it->second;
+
+  std::shared_ptr<PresetCatalog> c(new PresetCatalog);
+  std::string cachePath = cacheDirectory.empty() ? "" : cachePathFor(dir);
+  if (!cachePath.empty()) {
+    int fd = open(cachePath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+	c->mapping = p;
+	c->mappingSize = st.st_size;
+      }
+    }
+    if (fd >= 0) close(fd);
+  }
+  bool cached = c->mapping && c->attach(static_cast<const char*>(c->mapping), c->mappingSize);
+
+  // The cached catalog is current if the same files are there, with
+  // the same sizes and times. Hashes of unchanged files are reused.
+  std::vector<ScannedPreset> presets;
+  scan(dir, "", &presets);
+  std::unordered_map<std::string, const Entry*> known;
+  if (cached) {
+    for (size_t i = 0; i < c->count; ++i) known[c->relativePath(i)] = &c->entries[i];
+  }
+  bool current = cached && known.size() == presets.size();
+  size_t hashed = 0;
+  for (ScannedPreset& p : presets) {
+    auto k = known.find(p.path);
+    if (k != known.end() && k->second->size == p.size && k->second->mtime == p.mtime) {
+      p.hash = k->second->hash;
+    } else {
+      p.hash = hashFile(dir + "/" + p.path);
+      current = false;
+      ++hashed;
+    }
+  }
+  if (current) {
+    catalogs[dir] = c;
+    return c;
+  }
+
+  std::shared_ptr<PresetCatalog> fresh(new PresetCatalog);
+  fresh->owned = serialize(presets);
+  fresh->attach(fresh->owned.data(), fresh->owned.size());
+  rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Cataloged %zu presets in %s, %zu new or changed",
+		  presets.size(), dir.c_str(), hashed);
+
+  // Written to a temporary file then moved in place, so that another
+  // process never maps a partial catalog. Mapping it back lets the
+  // memory be shared with other processes and paged out.
+  if (!cachePath.empty()) {
+    std::string tmp = cachePath + ".tmp";
+    bool written;
+    {
+      std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+      f.write(fresh->owned.data(), fresh->owned.size());
+      written = (bool)f;
+    }
+    if (!written || std::rename(tmp.c_str(), cachePath.c_str())) {
+      std::remove(tmp.c_str());
+    } else {
+      int fd = open(cachePath.c_str(), O_RDONLY);
+      void* p = fd >= 0 ? mmap(nullptr, fresh->owned.size(), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+      if (fd >= 0) close(fd);
+      if (p != MAP_FAILED && !memcmp(p, fresh->owned.data(), fresh->owned.size())) {
+	fresh->mapping = p;
+	fresh->mappingSize = fresh->owned.size();
+	fresh->attach(static_cast<const char*>(p), fresh->mappingSize);
+	std::vector<char>().swap(fresh->owned);
+      } else if (p != MAP_FAILED) {
+	munmap(p, fresh->owned.size());
+      }
+    }
+  }
+  catalogs[dir] = fresh;
+  return fresh;
+}
+
+PresetCatalog::~PresetCatalog() {
+  if (mapping) munmap(mapping, mappingSize);
+}
+
+bool PresetCatalog::attach(const char* data, size_t size) {
+  count = 0;
+  entries = nullptr;
+  strings = nullptr;
+  byFileName.clear();
+  Header h;
+  if (size < sizeof(h)) return false;
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, kFileMagic, sizeof(h.magic)) || h.version != kFileVersion) return false;
+  size_t entriesSize = (size_t)h.count * sizeof(Entry);
+  if (size != sizeof(h) + entriesSize + h.stringsSize) return false;
+  const Entry* e = reinterpret_cast<const Entry*>(data + sizeof(h));
+  for (size_t i = 0; i < h.count; ++i) {
+    if ((uint64_t)e[i].path + e[i].pathLength > h.stringsSize ||
+	e[i].name < e[i].path || e[i].name + e[i].nameLength > e[i].path + e[i].pathLength) {
+      return false;
+    }
+  }
+  count = h.count;
+  entries = e;
+  strings = data + sizeof(h) + entriesSize;
+  for (size_t i = 0; i < count; ++i) {
+    const Entry& en = entries[i];
+    const char* end = strings + en.path + en.pathLength;
+    const char* slash = end;
+    while (slash > strings + en.path && slash[-1] != '/') --slash;
+    byFileName.insert(std::make_pair(std::string(slash, end), i));
+  }
+  return true;
+}
+
+std::string PresetCatalog::name(size_t i) const {
+  return std::string(strings + entries[i].name, entries[i].nameLength);
+}
+
+std::string PresetCatalog::relativePath(size_t i) const {
+  return std::string(strings + entries[i].path, entries[i].pathLength);
+}
+
+size_t PresetCatalog::find(std::string const& url) const {
+  size_t slash = url.find_last_of("/\\");
+  std::string fileName = slash == std::string::npos ? url : url.substr(slash + 1);
+  auto range = byFileName.equal_range(fileName);
+  size_t found = npos;
+  for (auto it = range.first; it != range.second; ++it) {
+    // Presets in subdirectories may share a file name, the longest
+    // relative path that matches wins
+    const Entry& e = entries[it->second];
+    if (url.size() < e.pathLength || (found != npos && entries[found].pathLength >= e.pathLength)) continue;
+    size_t start = url.size() - e.pathLength;
+    if ((start == 0 || url[start - 1] == '/' || url[start - 1] == '\\') &&
+	!url.compare(start, e.pathLength, strings + e.path, e.pathLength)) {
+      found = it->second;
+    }
+  }
+  return found;
+}
+
+std::vector<size_t> PresetCatalog::search(std::string const& query, size_t max) const {
+  std::vector<size_t> found;
+  std::string q;
+  for (char ch : query) q += tolower((unsigned char)ch);
+  for (size_t i = 0; i < count && found.size() < max; ++i) {
+    const char* n = strings + entries[i].name;
+    size_t len = entries[i].nameLength;
+    for (size_t start = 0; start + q.size() <= len; ++start) {
+      size_t k = 0;
+      while (k < q.size() && tolower((unsigned char)n[start + k]) == q[k]) ++k;
+      if (k == q.size()) {
+	found.push_back(i);
+	break;
+      }
+    }
+  }
+  return found;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#ifndef PRESET_CATALOG_HPP
+#define PRESET_CATALOG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// PresetCatalog lists the presets under a directory, sorted by name:
+// their names, paths, sizes and content hashes. It is built once per
+// directory and process, and kept on disk so that later sessions only
+// have to stat the files to know it's current; files that didn't
+// change aren't read again. The catalog is memory-mapped, and lookups
+// don't copy it, so menus can list thousands of presets without
+// asking projectM for anything.
+class PresetCatalog {
+public:
+  static const size_t npos = (size_t)-1;
+
+  // Directory catalogs are persisted under. Must exist. Until this is
+  // set, catalogs are only kept in memory.
+  static void setCacheDirectory(std::string const& dir);
+
+  // The catalog of the presets under dir, scanning the directory the
+  // first time it's asked for. Blocks while it does, which takes
+  // longer if presets were added or changed. Never null. Any thread.
+  static std::shared_ptr<const PresetCatalog> get(std::string const& dir);
+  // The catalog of dir if it's ready, or null while get(dir) runs on a
+  // background thread, which the first call starts. Never blocks. Any
+  // thread.
+  static std::shared_ptr<const PresetCatalog> tryGet(std::string const& dir);
+
+  ~PresetCatalog();
+
+  size_t size() const { return count; }
+
+  // The preset's file name, without its extension
+  std::string name(size_t i) const;
+  // Path relative to the directory
+  std::string relativePath(size_t i) const;
+  uint64_t fileSize(size_t i) const { return entries[i].size; }
+  uint64_t hash(size_t i) const { return entries[i].hash; }
+
+  // Index of the preset at url, a path under the directory such as
+  // projectM's getPresetURL() returns, or npos.
+  size_t find(std::string const& url) const;
+
+  // Indices of the first max presets whose name contains query,
+  // ignoring case, in catalog order.
+  std::vector<size_t> search(std::string const& query, size_t max) const;
+
+  // Layout of the catalog, in memory and on disk
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t stringsSize;
+  };
+  struct Entry {
+    uint32_t path, pathLength; // Offset in the strings and length
+    uint32_t name, nameLength;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash; // FNV-1a of the contents
+  };
+
+private:
+  PresetCatalog() {}
+  // Points the accessors at a catalog in data. Returns false if it's
+  // not a valid one.
+  bool attach(const char* data, size_t size);
+
+  // The catalog, either mapped from the cache or in owned
+  void* mapping = nullptr;
+  size_t mappingSize = 0;
+  std::vector<char> owned;
+  size_t count = 0;
+  const Entry* entries = nullptr;
+  const char* strings = nullptr;
+  // Entries by file name, for find()
+  std::unordered_multimap<std::string, size_t> byFileName;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "PresetCosts.hpp"
+#include "util/common.hpp"
+#include "jansson.h"
+#include <algorithm>
+
+// Presets that take longer than this many frames to load stall the
+// picture noticeably when switched to, and are picked half as often.
+static const double kSlowLoadFrames = 20;
+
+PresetCosts& PresetCosts::get() {
+  static PresetCosts costs;
+  return costs;
+}
+
+static double number(json_t* o, const char* key) {
+  json_t* j = json_object_get(o, key);
+  return j ? json_number_value(j) : 0;
+}
+
+bool PresetCosts::load(std::string const& path) {
+  std::lock_guard<std::mutex> l(m);
+  costs.clear();
+  reference = Reference();
+
+  json_t* rootJ = json_load_file(path.c_str(), 0, nullptr);
+  if (!rootJ) {
+    rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "No preset cost table at %s, presets will be picked regardless of their cost", path.c_str());
+    return false;
+  }
+  json_t* refJ = json_object_get(rootJ, "reference");
+  if (refJ) {
+    reference.width = number(refJ, "width");
+    reference.height = number(refJ, "height");
+    reference.frames = number(refJ, "frames");
+    json_t* j = json_object_get(refJ, "renderer");
+    if (j && json_is_string(j)) reference.renderer = json_string_value(j);
+  }
+  json_t* presetsJ = json_object_get(rootJ, "presets");
+  const char* name;
+  json_t* costJ;
+  json_object_foreach(presetsJ, name, costJ) {
+    Cost c;
+    c.failed = json_is_true(json_object_get(costJ, "failed"));
+    c.parseMs = number(costJ, "parseMs");
+    c.compileMs = number(costJ, "compileMs");
+    c.frameMeanMs = number(costJ, "frameMeanMs");
+    c.frameP99Ms = number(costJ, "frameP99Ms");
+    c.gpuMeanMs = number(costJ, "gpuMeanMs");
+    c.gpuP99Ms = number(costJ, "gpuP99Ms");
+    costs[name] = c;
+  }
+  json_decref(rootJ);
+  if (costs.empty()) {
+    rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "The preset cost table at %s has no presets, presets will be picked regardless of their cost", path.c_str());
+    reference = Reference();
+    return false;
+  }
+  rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Loaded costs of %d presets from %s", (int)costs.size(), path.c_str());
+  return true;
+}
+
+bool PresetCosts::save(std::string const& path, Reference const& ref, std::map<std::string, Cost> const& table) {
+  json_t* rootJ = json_object();
+  json_t* refJ = json_object();
+  json_object_set_new(refJ, "width", json_integer(ref.width));
+  json_object_set_new(refJ, "height", json_integer(ref.height));
+  json_object_set_new(refJ, "frames", json_integer(ref.frames));
+  json_object_set_new(refJ, "renderer", json_string(ref.renderer.c_str()));
+  json_object_set_new(rootJ, "reference", refJ);
+  json_t* presetsJ = json_object();
+  for (auto const& p : table) {
+    Cost const& c = p.second;
+    json_t* costJ = json_object();
+    if (c.failed) json_object_set_new(costJ, "failed", json_true());
+    json_object_set_new(costJ, "parseMs", json_real(c.parseMs));
+    json_object_set_new(costJ, "compileMs", json_real(c.compileMs));
+    json_object_set_new(costJ, "frameMeanMs", json_real(c.frameMeanMs));
+    json_object_set_new(costJ, "frameP99Ms", json_real(c.frameP99Ms));
+    json_object_set_new(costJ, "gpuMeanMs", json_real(c.gpuMeanMs));
+    json_object_set_new(costJ, "gpuP99Ms", json_real(c.gpuP99Ms));
+    json_object_set_new(presetsJ, p.first.c_str(), costJ);
+  }
+  json_object_set_new(rootJ, "presets", presetsJ);
+  bool ok = json_dump_file(rootJ, path.c_str(), JSON_INDENT(2) | JSON_SORT_KEYS) == 0;
+  json_decref(rootJ);
+  return ok;
+}
+
+double PresetCosts::weight(std::string const& name, double budgetMs, int width, int height) const {
+  std::lock_guard<std::mutex> l(m);
+  auto it = costs.find(name);
+  if (it == costs.end()) return 1;
+  Cost const& c = it->second;
+  if (c.failed) return 0;
+
+  // GPU time grows with the number of pixels, CPU time (mostly the
+  // per-vertex equations) doesn't
+  double gpu = c.gpuP99Ms;
+  if (reference.width > 0 && reference.height > 0) {
+    gpu *= (double)width * height / ((double)reference.width * reference.height);
+  }
+  double cost = std::max(c.frameP99Ms, gpu);
+  if (cost >= budgetMs) return 0;
+  double w = 1 - 0.75 * cost / budgetMs;
+  if (c.parseMs + c.compileMs > kSlowLoadFrames * budgetMs) w *= 0.5;
+  return w;
+}
+
+bool PresetCosts::empty() const {
+  std::lock_guard<std::mutex> l(m);
+  return costs.empty();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef PRESET_COSTS_HPP
+#define PRESET_COSTS_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// PresetCosts holds what each preset costs to load and render, as
+// measured by milkrack-bench on a reference machine and shipped in
+// res/preset_costs.json. Renderers use it to keep random picks and
+// autoplay away from presets that can't fit their frame budget.
+class PresetCosts {
+public:
+  struct Cost {
+    bool failed = false; // The preset didn't load
+    double parseMs = 0; // Loading up to the first frame, minus shader compilation
+    double compileMs = 0; // Compiling and linking shaders
+    double frameMeanMs = 0; // renderFrame(), CPU side
+    double frameP99Ms = 0;
+    double gpuMeanMs = 0; // renderFrame(), GPU side
+    double gpuP99Ms = 0;
+  };
+
+  // The frame size the costs were measured at
+  struct Reference {
+    int width = 0;
+    int height = 0;
+    int frames = 0;
+    std::string renderer; // GL_RENDERER of the benchmark machine
+  };
+
+  static PresetCosts& get();
+
+  // Replaces the table with the one in path. Returns false if it
+  // can't be read, leaving the table empty.
+  bool load(std::string const& path);
+
+  // Writes the given table to path.
+  static bool save(std::string const& path, Reference const& ref, std::map<std::string, Cost> const& costs);
+
+  // Relative odds, between 0 and 1, of picking the preset named name
+  // at random, for a renderer drawing width x height frames with
+  // budgetMs per frame. 0 means the preset doesn't fit the budget or
+  // doesn't load. Presets missing from the table get 1.
+  double weight(std::string const& name, double budgetMs, int width, int height) const;
+
+  bool empty() const;
+
+private:
+  PresetCosts() {}
+
+  mutable std::mutex m;
+  Reference reference;
+  std::map<std::string, Cost> costs;
+};
+
+#endif
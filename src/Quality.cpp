@@ -0,0 +1,60 @@
+#include "Quality.hpp"
+#include <algorithm>
+
+struct QualitySettings {
+  int meshX, meshY;
+  int textureSize;
+  int smoothPresetDuration; // Blends render two presets at once
+};
+
+// QUALITY_LOW to QUALITY_ULTRA. projectM's defaults are medium.
+static const QualitySettings kTiers[] = {
+  {24, 18, 512, 0},
+  {32, 24, 512, 10},
+  {48, 36, 1024, 10},
+  {64, 48, 2048, 10},
+};
+
+// Calibration frames are from whatever preset is playing. Leave room
+// for the heavier ones.
+static const double kCalibrationLoad = 0.5;
+
+const char* qualityName(Quality q) {
+  switch (q) {
+  case QUALITY_CUSTOM: return "custom";
+  case QUALITY_LOW: return "low";
+  case QUALITY_MEDIUM: return "medium";
+  case QUALITY_HIGH: return "high";
+  case QUALITY_ULTRA: return "ultra";
+  case QUALITY_AUTO: return "auto";
+  default: return "";
+  }
+}
+
+Quality qualityFromName(std::string const& name) {
+  for (int q = 0; q < NUM_QUALITIES; ++q) {
+    if (name == qualityName((Quality)q)) return (Quality)q;
+  }
+  return QUALITY_AUTO;
+}
+
+void applyQuality(Quality q, projectM::Settings* s) {
+  if (q < QUALITY_LOW || q > QUALITY_ULTRA) return;
+  QualitySettings const& t = kTiers[q - QUALITY_LOW];
+  s->meshX = t.meshX;
+  s->meshY = t.meshY;
+  s->textureSize = t.textureSize;
+  s->smoothPresetDuration = t.smoothPresetDuration;
+}
+
+Quality calibrateQuality(projectM::Settings const& s, double cpuMs, double gpuMs, double budgetMs) {
+  double vertices = (double)s.meshX * s.meshY;
+  double texels = (double)s.textureSize * s.textureSize;
+  for (int q = QUALITY_ULTRA; q > QUALITY_LOW; --q) {
+    QualitySettings const& t = kTiers[q - QUALITY_LOW];
+    double cpu = cpuMs * t.meshX * t.meshY / vertices;
+    double gpu = gpuMs * t.textureSize * t.textureSize / texels;
+    if (std::max(cpu, gpu) <= kCalibrationLoad * budgetMs) return (Quality)q;
+  }
+  return QUALITY_LOW;
+}
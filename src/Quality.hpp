@@ -0,0 +1,35 @@
+#pragma once
+#ifndef QUALITY_HPP
+#define QUALITY_HPP
+
+#include "deps/projectm/src/libprojectM/projectM.hpp"
+#include <string>
+
+// Quality tiers, each a set of projectM settings trading detail for
+// frame time.
+enum Quality {
+  QUALITY_CUSTOM, // The settings the renderer was given, left alone
+  QUALITY_LOW,
+  QUALITY_MEDIUM,
+  QUALITY_HIGH,
+  QUALITY_ULTRA,
+  QUALITY_AUTO, // The best tier a short calibration render says fits
+  NUM_QUALITIES
+};
+
+// Name used in menus and patches
+const char* qualityName(Quality q);
+
+// Inverse of qualityName(). Unknown names give QUALITY_AUTO.
+Quality qualityFromName(std::string const& name);
+
+// Sets the mesh size, texture size and blend time of tier q, from
+// QUALITY_LOW to QUALITY_ULTRA. Other values leave s untouched.
+void applyQuality(Quality q, projectM::Settings* s);
+
+// Picks the best tier for a renderer that took cpuMs and gpuMs per
+// frame with settings s, out of budgetMs. Per-vertex equations make
+// CPU time grow with the mesh, GPU time grows with the texture.
+Quality calibrateQuality(projectM::Settings const& s, double cpuMs, double gpuMs, double budgetMs);
+
+#endif
@@ -0,0 +1,421 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "RenderService.hpp"
+#include "Renderer.hpp"
+#include "TextureCache.hpp"
+#include "GLFW/glfw3.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+// How long an idle worker sleeps before re-checking its renderers
+static const std::chrono::milliseconds kIdleWait(250);
+// Creating a context takes tens of milliseconds. Loading a patch full
+// of instances creates theirs one UI frame or so apart instead of all
+// in the same one.
+static const std::chrono::milliseconds kStartInterval(15);
+
+RenderWorker::RenderWorker(RenderService* service, bool dedicated) : service(service), dedicated(dedicated) {
+  thread = std::thread([this](){ this->run(); });
+}
+
+RenderWorker::~RenderWorker() {
+  stop();
+}
+
+void RenderWorker::stop() {
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> l(service->m);
+    quit = true;
+    wake.notify_one();
+  }
+  thread.join();
+}
+
+void RenderWorker::makeCurrent(ProjectMRenderer* r) {
+  if (current == r->contextHandle()) return;
+  // Contexts may come from different APIs (GLFW, EGL), which don't
+  // release each other's.
+  releaseCurrent();
+  r->makeContextCurrent();
+  current = r->contextHandle();
+  currentOwner = r;
+#ifdef MILKRACK_TEXTURE_CACHE
+  // Only contexts shared with Rack's window can share textures
+  TextureCache::setCurrentContext(r->canShareContext() ? current : nullptr);
+#endif
+}
+
+void RenderWorker::releaseCurrent() {
+  if (currentOwner) currentOwner->releaseContext();
+  current = nullptr;
+  currentOwner = nullptr;
+#ifdef MILKRACK_TEXTURE_CACHE
+  TextureCache::setCurrentContext(nullptr);
+#endif
+}
+
+void RenderWorker::run() {
+  std::unique_lock<std::mutex> l(service->m);
+  while (!quit) {
+    // Start renderers handed to us. Ones that were already started
+    // were moved here from another worker.
+    std::vector<ProjectMRenderer*> toAdd;
+    toAdd.swap(adding);
+    for (ProjectMRenderer* r : toAdd) {
+      l.unlock();
+      bool ok = r->started;
+      if (!ok) {
+	if (r->contextHandle()) makeCurrent(r);
+	ok = r->started = r->renderLoopStart();
+      }
+      if (ok) {
+	r->nextFrameDue = FramePacer::Clock::now();
+	renderers.push_back(r);
+      }
+      l.lock();
+    }
+
+    // Stop renderers that are going away
+    if (!removing.empty()) {
+      std::vector<ProjectMRenderer*> toRemove;
+      toRemove.swap(removing);
+      l.unlock();
+      for (ProjectMRenderer* r : toRemove) {
+	auto it = std::find(renderers.begin(), renderers.end(), r);
+	if (it != renderers.end()) {
+	  makeCurrent(r);
+	  r->renderLoopStop();
+	  renderers.erase(it);
+	}
+      }
+      // The main thread may destroy these contexts as soon as we
+      // signal, so they must not be current here anymore.
+      releaseCurrent();
+      l.lock();
+      for (ProjectMRenderer* r : toRemove) {
+	r->worker = nullptr;
+	--load;
+      }
+      service->detached.notify_all();
+      continue;
+    }
+
+    if (renderers.empty()) {
+      wake.wait_for(l, kIdleWait);
+      continue;
+    }
+
+    l.unlock();
+    FramePacer::Clock::time_point wakeAt = renderPass();
+
+    // Move renderers whose needs changed (e.g. vsync was toggled) to
+    // a worker that suits them.
+    for (size_t i = 0; i < renderers.size();) {
+      ProjectMRenderer* r = renderers[i];
+      if (r->wantsDedicatedThread() == dedicated || r->getStatus() == ProjectMRenderer::Status::PLEASE_EXIT) {
+	++i;
+	continue;
+      }
+      renderers.erase(renderers.begin() + i);
+      releaseCurrent();
+      std::lock_guard<std::mutex> hl(service->m);
+      // The renderer may have started exiting since we checked, in
+      // which case its removal is about to be queued here.
+      if (r->getStatus() == ProjectMRenderer::Status::PLEASE_EXIT) {
+	renderers.insert(renderers.begin() + i, r);
+	++i;
+	continue;
+      }
+      service->handoff(this, r);
+    }
+    l.lock();
+
+    if (adding.empty() && removing.empty() && !quit) {
+      wake.wait_until(l, wakeAt);
+    }
+  }
+
+  // The service is going away. Whatever is still here is stopped on
+  // this thread, and the service releases the contexts.
+  std::vector<ProjectMRenderer*> left;
+  left.swap(renderers);
+  l.unlock();
+  for (ProjectMRenderer* r : left) {
+    makeCurrent(r);
+    r->renderLoopStop();
+  }
+  releaseCurrent();
+  l.lock();
+  left.insert(left.end(), adding.begin(), adding.end());
+  adding.clear();
+  removing.clear();
+  for (ProjectMRenderer* r : left) {
+    r->worker = nullptr;
+    --load;
+    service->abandoned.push_back(r);
+  }
+  service->detached.notify_all();
+}
+
+FramePacer::Clock::time_point RenderWorker::renderPass() {
+  FramePacer::Clock::time_point now = FramePacer::Clock::now();
+  size_t n = renderers.size();
+  passCosts.clear();
+  // Set if the pass took longer than a frame, or made a renderer
+  // miss its slot
+  bool contended = false;
+  FramePacer::Clock::duration busy(0);
+  FramePacer::Clock::duration shortestPeriod = FramePacer::Clock::duration::max();
+  for (size_t k = 0; k < n; ++k) {
+    ProjectMRenderer* r = renderers[(roundRobin + k) % n];
+    // A hidden renderer coming back into view renders at once
+    if (r->nextFrameDue <= now || (r->hidden && r->getRequestedVisible())) {
+      makeCurrent(r);
+      FramePacer::Clock::time_point start = FramePacer::Clock::now();
+      if (start - r->nextFrameDue > r->pacer.framePeriod() / n) contended = true;
+      r->renderLoopStep();
+      now = FramePacer::Clock::now();
+      r->nextFrameDue = r->renderLoopSchedule(now);
+      FramePacer::Clock::duration cost = now - start;
+      busy += cost;
+      shortestPeriod = std::min(shortestPeriod, r->pacer.framePeriod());
+      passCosts.push_back(std::make_pair(r, cost));
+    }
+  }
+  contended = contended || busy > shortestPeriod;
+
+  // Each renderer's budget is an even share of the thread. When the
+  // thread can't keep up, one that went over it gets its next frame
+  // pushed back by the overrun, so a heavy preset slows itself down
+  // instead of everyone else on the thread. While there's time to
+  // spare, nobody is held back.
+  if (n > 1 && contended) {
+    for (auto const& p : passCosts) {
+      ProjectMRenderer* r = p.first;
+      FramePacer::Clock::duration budget = r->pacer.framePeriod() / n;
+      if (!r->vsyncActive && !r->hidden && p.second > budget) {
+	r->nextFrameDue = r->pacer.postpone(p.second - budget);
+      }
+    }
+  }
+
+  FramePacer::Clock::time_point wakeAt = now + kIdleWait;
+  for (ProjectMRenderer* r : renderers) {
+    wakeAt = std::min(wakeAt, r->nextFrameDue);
+  }
+  roundRobin = n ? (roundRobin + 1) % n : 0;
+  return wakeAt;
+}
+
+
+RenderService& RenderService::get() {
+  static RenderService service;
+  return service;
+}
+
+RenderService::RenderService() {
+  // Leave room for Rack's engine and UI threads
+  poolSize = std::max(1u, std::thread::hardware_concurrency() / 2);
+}
+
+RenderService::~RenderService() {
+  std::vector<RenderWorker*> workers(pool);
+  workers.insert(workers.end(), dedicatedWorkers.begin(), dedicatedWorkers.end());
+  // Each worker stops its renderers before its thread ends
+  for (RenderWorker* w : workers) w->stop();
+  std::vector<ProjectMRenderer*> stopped;
+  {
+    std::lock_guard<std::mutex> l(m);
+    starting.clear();
+    // Renderers nobody retired still belong to their owners, only
+    // their contexts go
+    for (ProjectMRenderer* r : abandoned) releaseContext(r);
+    abandoned.clear();
+    stopped = collectRetired();
+  }
+  for (ProjectMRenderer* r : stopped) delete r;
+  // Shared contexts were released above, the workers can go
+  for (RenderWorker* w : workers) delete w;
+}
+
+RenderWorker* RenderService::pickWorker(bool dedicated) {
+  if (dedicated) {
+    for (RenderWorker* w : dedicatedWorkers) {
+      if (!w->load) return w;
+    }
+    dedicatedWorkers.push_back(new RenderWorker(this, true));
+    return dedicatedWorkers.back();
+  }
+  RenderWorker* best = nullptr;
+  for (RenderWorker* w : pool) {
+    if (!best || w->load < best->load) best = w;
+  }
+  if (!best || (best->load && pool.size() < poolSize)) {
+    pool.push_back(new RenderWorker(this, false));
+    best = pool.back();
+  }
+  return best;
+}
+
+void RenderService::attach(ProjectMRenderer* r) {
+  std::lock_guard<std::mutex> l(m);
+  starting.push_back(r);
+}
+
+void RenderService::start(ProjectMRenderer* r) {
+  RenderWorker* w = pickWorker(r->wantsDedicatedThread());
+  if (r->canShareContext()) {
+    if (!w->sharedContext) {
+      w->sharedContext = r->createWindow();
+    }
+    r->window = w->sharedContext;
+    r->ownsWindow = false;
+    if (r->window) {
+      ++w->sharedContextUsers;
+      r->sharedWith = w;
+    }
+  } else {
+    r->createContext();
+    r->ownsWindow = true;
+  }
+  r->worker = w;
+  ++w->load;
+  w->adding.push_back(r);
+  w->wake.notify_one();
+}
+
+void RenderService::detach(ProjectMRenderer* r) {
+  std::unique_lock<std::mutex> l(m);
+  auto it = std::find(starting.begin(), starting.end(), r);
+  if (it != starting.end()) {
+    starting.erase(it);
+    return;
+  }
+  RenderWorker* w = r->worker;
+  if (!w) return;
+  w->removing.push_back(r);
+  w->wake.notify_one();
+  detached.wait(l, [r](){ return r->worker == nullptr; });
+  releaseContext(r);
+}
+
+void RenderService::releaseContext(ProjectMRenderer* r) {
+  // Destroy the context in the main thread, because it's not legal
+  // to do so in other threads.
+  if (!r->contextHandle()) return;
+  RenderWorker* w = r->sharedWith;
+  if (r->ownsWindow) {
+    r->destroyContext();
+  } else {
+    if (--w->sharedContextUsers == 0) {
+#ifdef MILKRACK_TEXTURE_CACHE
+      TextureCache::get().forgetContext(w->sharedContext);
+#endif
+      glfwDestroyWindow(w->sharedContext);
+      w->sharedContext = nullptr;
+    }
+    r->window = nullptr;
+    r->sharedWith = nullptr;
+  }
+}
+
+void RenderService::retire(ProjectMRenderer* r) {
+  r->requestExit();
+  // Rack stops its UI loop when its window is asked to close, and
+  // destroys every window next.
+  if (rack::gWindow && glfwWindowShouldClose(rack::gWindow)) {
+    delete r;
+    return;
+  }
+  std::unique_lock<std::mutex> l(m);
+  auto it = std::find(starting.begin(), starting.end(), r);
+  if (it != starting.end()) {
+    starting.erase(it);
+  } else if (r->worker) {
+    r->worker->removing.push_back(r);
+    r->worker->wake.notify_one();
+    if (r->ownsWindow && r->window) glfwHideWindow(r->window);
+  }
+  retiring.push_back(r);
+
+  // pump() is called by the instances' widgets. With none left it
+  // won't be anymore, so the retired renderers are finished here.
+  // Their render threads only have to get to them, which takes a
+  // frame or so.
+  if (activeCount() == 0) {
+    detached.wait(l, [this](){
+      for (ProjectMRenderer* r : retiring) {
+	if (r->worker) return false;
+      }
+      return true;
+    });
+    std::vector<ProjectMRenderer*> stopped = collectRetired();
+    l.unlock();
+    for (ProjectMRenderer* r : stopped) delete r;
+  }
+}
+
+size_t RenderService::activeCount() const {
+  size_t n = starting.size();
+  for (RenderWorker* w : pool) n += w->load;
+  for (RenderWorker* w : dedicatedWorkers) n += w->load;
+  for (ProjectMRenderer* r : retiring) {
+    if (r->worker) --n;
+  }
+  return n;
+}
+
+std::vector<ProjectMRenderer*> RenderService::collectRetired() {
+  std::vector<ProjectMRenderer*> stopped;
+  for (size_t i = 0; i < retiring.size();) {
+    ProjectMRenderer* r = retiring[i];
+    if (r->worker) {
+      ++i;
+      continue;
+    }
+    releaseContext(r);
+    stopped.push_back(r);
+    retiring.erase(retiring.begin() + i);
+  }
+  return stopped;
+}
+
+void RenderService::pump() {
+  std::vector<ProjectMRenderer*> stopped;
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopped = collectRetired();
+    FramePacer::Clock::time_point now = FramePacer::Clock::now();
+    if (!starting.empty() && now >= nextStart) {
+      ProjectMRenderer* r = starting.front();
+      starting.erase(starting.begin());
+      start(r);
+      nextStart = FramePacer::Clock::now() + kStartInterval;
+    }
+  }
+  // Their render threads are done with them, the dtors return at once
+  for (ProjectMRenderer* r : stopped) delete r;
+}
+
+void RenderService::wake(ProjectMRenderer* r) {
+  std::lock_guard<std::mutex> l(m);
+  if (r->worker) r->worker->wake.notify_one();
+}
+
+size_t RenderService::pendingCount() {
+  std::lock_guard<std::mutex> l(m);
+  return starting.size() + retiring.size();
+}
+
+void RenderService::handoff(RenderWorker* from, ProjectMRenderer* r) {
+  RenderWorker* to = pickWorker(r->wantsDedicatedThread());
+  --from->load;
+  ++to->load;
+  r->worker = to;
+  to->adding.push_back(r);
+  to->wake.notify_one();
+}
@@ -0,0 +1,144 @@
+#pragma once
+#ifndef RENDER_SERVICE_HPP
+#define RENDER_SERVICE_HPP
+
+#include "GLFW/glfw3.h"
+#include "FramePacer.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ProjectMRenderer;
+class RenderService;
+
+// A render thread multiplexing any number of ProjectMRenderers. Each
+// pass visits every renderer whose next frame is due, starting one
+// renderer further along each time so that nobody is always last,
+// then sleeps until the earliest upcoming deadline.
+class RenderWorker {
+  friend class RenderService;
+
+public:
+  RenderWorker(RenderService* service, bool dedicated);
+  ~RenderWorker();
+
+private:
+  // Stops the renderers still on this worker and ends its thread.
+  // Main thread only.
+  void stop();
+  void run();
+  // Renders every renderer whose frame is due and returns when the
+  // next one is. Render thread only.
+  FramePacer::Clock::time_point renderPass();
+  // Makes r's context current on this thread, unless it already is.
+  void makeCurrent(ProjectMRenderer* r);
+  // Leaves no context current on this thread.
+  void releaseCurrent();
+
+  RenderService* service;
+  // Dedicated workers serve renderers that block on vsync, so that
+  // they don't hold up anyone else.
+  const bool dedicated;
+  std::thread thread;
+
+  // Guarded by the RenderService's lock
+  std::condition_variable wake;
+  std::vector<ProjectMRenderer*> adding;
+  std::vector<ProjectMRenderer*> removing;
+  size_t load = 0; // Renderers assigned to this worker
+  bool quit = false;
+  // Hidden context shared by all the renderers on this worker that
+  // allow it, and how many of them use it.
+  GLFWwindow* sharedContext = nullptr;
+  int sharedContextUsers = 0;
+
+  // Render thread only
+  std::vector<ProjectMRenderer*> renderers;
+  size_t roundRobin = 0;
+  // Renderers drawn in the current pass and what each frame cost
+  std::vector<std::pair<ProjectMRenderer*, FramePacer::Clock::duration> > passCosts;
+  // Context current on this thread, and a renderer using it
+  const void* current = nullptr;
+  ProjectMRenderer* currentOwner = nullptr;
+};
+
+// RenderService owns the render threads: a pool sized to the machine
+// shared by all Milkrack instances, plus one thread per renderer that
+// needs its own. Renderers that can share a context do so with the
+// others on the same thread.
+class RenderService {
+  friend class RenderWorker;
+
+public:
+  static RenderService& get();
+  ~RenderService();
+
+  // Queues r to get a context from pump(), after which it starts
+  // rendering on one of the render threads. Returns at once. Main
+  // thread only.
+  void attach(ProjectMRenderer* r);
+
+  // Stops rendering r and waits until no render thread references
+  // it, then releases its context. Main thread only.
+  void detach(ProjectMRenderer* r);
+
+  // Takes r over and asks its render thread to stop it. pump()
+  // releases its context and deletes it once that's done. Returns at
+  // once, unless Rack is quitting, in which case r is stopped and
+  // deleted right away: its context must be gone before Rack's
+  // window. When r was the last renderer, nothing calls pump()
+  // anymore, so retire() waits for the retired ones to stop and
+  // deletes them itself. Main thread only.
+  void retire(ProjectMRenderer* r);
+
+  // The main thread's share of the work. Creates the context of the
+  // next renderer waiting to start, at most one every
+  // kStartInterval, and deletes retired renderers that stopped. To
+  // be called regularly. Main thread only.
+  void pump();
+
+  // Wakes r's render thread, if it has one, so a renderer that was
+  // idling renders its next frame right away. Any thread.
+  void wake(ProjectMRenderer* r);
+
+  // Renderers waiting for pump() to start them, and retired ones not
+  // deleted yet. Main thread only.
+  size_t pendingCount();
+
+private:
+  RenderService();
+  // Creates or picks r's context and hands r to a worker. Main
+  // thread only, lock held.
+  void start(ProjectMRenderer* r);
+  // Destroys r's context, or lets go of its shared one. Main thread
+  // only, lock held.
+  void releaseContext(ProjectMRenderer* r);
+  // Returns the worker a new renderer should go to. Lock held.
+  RenderWorker* pickWorker(bool dedicated);
+  // Renderers that are started or waiting to be, not counting retired
+  // ones. Lock held.
+  size_t activeCount() const;
+  // Releases the contexts of retired renderers that stopped, and
+  // returns them to be deleted. Main thread only, lock held.
+  std::vector<ProjectMRenderer*> collectRetired();
+  // Moves a started renderer from one worker to another that suits
+  // it better. Called from the source worker's thread, lock held.
+  void handoff(RenderWorker* from, ProjectMRenderer* r);
+
+  std::mutex m;
+  std::condition_variable detached;
+  std::vector<RenderWorker*> pool;
+  std::vector<RenderWorker*> dedicatedWorkers;
+  unsigned poolSize;
+  // Renderers attach() queued for pump() to start
+  std::vector<ProjectMRenderer*> starting;
+  FramePacer::Clock::time_point nextStart;
+  // Renderers retire() took over, until pump() deletes them
+  std::vector<ProjectMRenderer*> retiring;
+  // Renderers workers stopped because they were quitting, whose
+  // contexts are left to release
+  std::vector<ProjectMRenderer*> abandoned;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "RenderStats.hpp"
+
+const char* RenderStats::stageName(Stage s) {
+  switch (s) {
+  case FRAME: return "frame";
+  case RENDER: return "render";
+  case GPU: return "gpu";
+  case PRESET_SWITCH: return "presetSwitch";
+  case RESIZE: return "resize";
+  case SWAP: return "swap";
+  default: return "";
+  }
+}
+
+void RenderStats::applyReset() {
+  if (!resetRequested.exchange(false)) return;
+  for (int i = 0; i < NUM_STAGES; ++i) stages[i].reset();
+  pcmFill.reset();
+}
+
+static json_t* histogramToJson(Histogram const& h) {
+  json_t* j = json_object();
+  json_object_set_new(j, "count", json_integer(h.count()));
+  json_object_set_new(j, "mean", json_real(h.mean()));
+  json_object_set_new(j, "p50", json_integer(h.percentile(0.5)));
+  json_object_set_new(j, "p99", json_integer(h.percentile(0.99)));
+  json_object_set_new(j, "max", json_integer(h.max()));
+  return j;
+}
+
+json_t* RenderStats::toJson() const {
+  json_t* rootJ = json_object();
+  json_t* stagesJ = json_object();
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    json_object_set_new(stagesJ, stageName((Stage)i), histogramToJson(stages[i]));
+  }
+  json_object_set_new(rootJ, "stagesMicroseconds", stagesJ);
+  json_object_set_new(rootJ, "pcmFillFrames", histogramToJson(pcmFill));
+  return rootJ;
+}
+
+
+void GPUTimer::initGL() {
+  glGenQueries(kQueries, queries);
+  ready = true;
+}
+
+void GPUTimer::releaseGL() {
+  if (!ready) return;
+  glDeleteQueries(kQueries, queries);
+  for (int i = 0; i < kQueries; ++i) pending[i] = false;
+  ready = running = false;
+}
+
+void GPUTimer::begin() {
+  // If every query is still in flight, skip this measurement rather
+  // than wait for one
+  if (!ready || pending[next]) return;
+  glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+  running = true;
+}
+
+void GPUTimer::end() {
+  if (!running) return;
+  glEndQuery(GL_TIME_ELAPSED);
+  pending[next] = true;
+  next = (next + 1) % kQueries;
+  running = false;
+}
+
+uint64_t GPUTimer::collect(RenderStats& stats) {
+  uint64_t latest = 0;
+  // Oldest first, results become available in order
+  for (int k = 0; k < kQueries; ++k) {
+    int i = (next + k) % kQueries;
+    if (!pending[i]) continue;
+    GLint available = 0;
+    glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) break;
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+    latest = ns / 1000;
+    stats.record(RenderStats::GPU, latest);
+    pending[i] = false;
+  }
+  return latest;
+}
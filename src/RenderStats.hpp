@@ -0,0 +1,96 @@
+#pragma once
+#ifndef RENDER_STATS_HPP
+#define RENDER_STATS_HPP
+
+#include "GLFW/glfw3.h"
+#include "Histogram.hpp"
+#include "jansson.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// RenderStats collects where a renderer's frame time goes. The render
+// thread records into it, anyone may read it.
+class RenderStats {
+public:
+  enum Stage {
+    FRAME, // A whole render step, everything below included
+    RENDER, // projectM's renderFrame(), CPU side
+    GPU, // projectM's renderFrame(), GPU side
+    PRESET_SWITCH, // Loading a preset
+    RESIZE, // Reallocating projectM's buffers
+    SWAP, // Presenting the frame
+    NUM_STAGES
+  };
+
+  static const char* stageName(Stage s);
+
+  RenderStats() : resetRequested(false) {}
+
+  // Durations in microseconds, per stage. Render thread only.
+  void record(Stage s, uint64_t us) { stages[s].record(us); }
+  Histogram const& stage(Stage s) const { return stages[s]; }
+
+  // Audio frames waiting in the PCM buffer at the start of each
+  // frame. Render thread only.
+  void recordPCMFill(size_t frames) { pcmFill.record(frames); }
+  Histogram const& getPCMFill() const { return pcmFill; }
+
+  // Asks the render thread to start over. Any thread.
+  void requestReset() { resetRequested.store(true); }
+  // Honours requestReset(). Render thread only.
+  void applyReset();
+
+  // Builds a JSON object with every histogram's count, mean, p50,
+  // p99 and max. The caller owns the result.
+  json_t* toJson() const;
+
+private:
+  Histogram stages[NUM_STAGES];
+  Histogram pcmFill;
+  std::atomic<bool> resetRequested;
+};
+
+// Records the time between its construction and destruction.
+class StageTimer {
+public:
+  StageTimer(RenderStats& stats, RenderStats::Stage s) : stats(stats), s(s), start(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    stats.record(s, elapsedMicroseconds());
+  }
+
+  uint64_t elapsedMicroseconds() const {
+    std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+
+private:
+  RenderStats& stats;
+  RenderStats::Stage s;
+  std::chrono::steady_clock::time_point start;
+};
+
+// GPUTimer measures GPU time with GL_TIME_ELAPSED queries. Results
+// are only picked up once available, a few frames later, so measuring
+// never stalls the pipeline. Render thread only, with the context
+// that created it current.
+class GPUTimer {
+public:
+  void initGL();
+  void releaseGL();
+  void begin();
+  void end();
+  // Records finished measurements into stats' GPU stage. Returns the
+  // latest one in microseconds, or 0 if none finished.
+  uint64_t collect(RenderStats& stats);
+
+private:
+  static const int kQueries = 4;
+  GLuint queries[kQueries] = {0};
+  bool pending[kQueries] = {false};
+  int next = 0; // Query the next measurement uses
+  bool ready = false;
+  bool running = false;
+};
+
+#endif
@@ -2,218 +2,765 @@
 #include "window.hpp"
 
 #include "Renderer.hpp"
+#include "RenderService.hpp"
+#include "PresetCosts.hpp"
 #include "GLFW/glfw3.h"
 #include "deps/projectm/src/libprojectM/projectM.hpp"
 #include "glfwUtils.hpp"
 #include "util/common.hpp"
-#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <mutex>
 
-void ProjectMRenderer::init(projectM::Settings const& s) {
-  window = createWindow();
-  renderThread = std::thread([this, s](){ this->renderLoop(s); });
+// While hidden, a renderer wakes this often to drain its audio, and
+// renders one frame every kHiddenFrameTicks wakeups so projectM's
+// beat detection and preset timing keep going.
+static const std::chrono::milliseconds kHiddenTick(100);
+static const int kHiddenFrameTicks = 10;
+// Seconds of frames after a preset switch that are taken up by
+// loading it, and compiling its shaders
+static const double kPresetLoadSeconds = 1;
+
+void ProjectMRenderer::init(projectM::Settings const& s, std::shared_ptr<PCMBuffer> pcm) {
+  settings = s;
+  pcmBuffer = pcm;
+  // Starts scanning the preset directory now, the renderer picks the
+  // catalog up once it's built
+  PresetCatalog::tryGet(s.presetURL);
+  RenderService::get().attach(this);
+}
+
+void ProjectMRenderer::requestExit() {
+  // Let the render thread know we're going away, so it doesn't try
+  // to move us to another thread in the meantime, and ignores any
+  // request queued after this.
+  status.store(Status::PLEASE_EXIT);
+  sendCommand(Command::QUIT);
+}
+
+void ProjectMRenderer::shutdown() {
+  requestExit();
+  // Wait for the render thread to stop rendering us, then release
+  // the window in the main thread, because it's not legal to do so
+  // in other threads.
+  RenderService::get().detach(this);
+}
+
+void ProjectMRenderer::retire() {
+  RenderService::get().retire(this);
 }
 
 ProjectMRenderer::~ProjectMRenderer() {
-  // Request that the render thread terminates the renderLoop
-  setStatus(Status::PLEASE_EXIT);
-  // Wait for renderLoop to terminate before releasing resources
-  renderThread.join();
-  // Destroy the window in the main thread, because it's not legal
-  // to do so in other threads.
-  glfwDestroyWindow(window);
+  shutdown();
 }
 
-void ProjectMRenderer::addPCMData(float* data, unsigned int nsamples) {
-  std::lock_guard<std::mutex> l(pm_m);
-  if (!pm) return;
-  pm->pcm()->addPCMfloat_2ch(data, nsamples);
+bool ProjectMRenderer::sendCommand(Command::Type type, int arg) {
+  Command c = {type, arg};
+  if (commands.push(c)) return true;
+  rack::loggerLog(rack::WARN_LEVEL, "Milkrack/" __FILE__, __LINE__, "Render command queue full, dropping command %d", (int)type);
+  return false;
 }
 
 // Requests that projectM changes the preset at the next opportunity
 void ProjectMRenderer::requestPresetID(int id) {
-  std::lock_guard<std::mutex> l(flags_m);
-  requestedPresetID = id;
+  if (id == kPresetIDKeep) return;
+  sendCommand(Command::SET_PRESET, id);
+}
+
+void ProjectMRenderer::requestCatalogPreset(size_t i) {
+  sendCommand(Command::SET_CATALOG_PRESET, i);
 }
 
-// Requests that projectM changes the autoplay status
+// Requests that the renderer changes the autoplay status
 void ProjectMRenderer::requestToggleAutoplay() {
+  sendCommand(Command::TOGGLE_AUTOPLAY);
+}
+
+void ProjectMRenderer::requestResize() {
+  sendCommand(Command::RESIZE);
+}
+
+void ProjectMRenderer::setTargetFPS(float fps) {
+  requestedFPS.store(fps);
+}
+
+void ProjectMRenderer::setVSync(bool enable) {
+  requestedVSync.store(enable);
+}
+
+void ProjectMRenderer::setDynamicResolution(bool enable) {
+  requestedDynamicResolution.store(enable);
+}
+
+void ProjectMRenderer::setVisible(bool visible) {
+  if (requestedVisible.exchange(visible) == visible || !visible) return;
+  // Back in view, don't wait for the next hidden tick
+  RenderService::get().wake(this);
+}
+
+void ProjectMRenderer::setQuality(Quality q) {
+  requestedQuality.store(q);
+}
+
+void ProjectMRenderer::startCapture(CaptureSettings const& s) {
+  std::shared_ptr<FrameCapture> c = std::make_shared<FrameCapture>(s);
   std::lock_guard<std::mutex> l(flags_m);
-  requestedToggleAutoplay = true;
+  requestedCapture.swap(c);
+  captureRequested = true;
+  capturing = true;
+  // A capture the render thread hasn't picked up yet is dropped
+  FrameCapture::dispose(std::move(c));
 }
 
-// True if projectM is autoplaying presets
+void ProjectMRenderer::stopCapture() {
+  std::shared_ptr<FrameCapture> c;
+  std::lock_guard<std::mutex> l(flags_m);
+  requestedCapture.swap(c);
+  captureRequested = true;
+  capturing = false;
+  FrameCapture::dispose(std::move(c));
+}
+
+bool ProjectMRenderer::isCapturing() const {
+  std::lock_guard<std::mutex> l(flags_m);
+  return capturing;
+}
+
+uint64_t ProjectMRenderer::skippedFrames() const {
+  return pacer.skippedFrames();
+}
+
+json_t* ProjectMRenderer::statsToJson() const {
+  json_t* rootJ = stats.toJson();
+  json_object_set_new(rootJ, "preset", json_string(activePresetName().c_str()));
+  json_object_set_new(rootJ, "skippedFrames", json_integer(skippedFrames()));
+  json_object_set_new(rootJ, "renderScale", json_real(renderScale()));
+  json_object_set_new(rootJ, "quality", json_string(qualityName(activeQuality())));
+  if (pcmBuffer) {
+    json_object_set_new(rootJ, "pcmOverruns", json_integer(pcmBuffer->overrunCount()));
+    json_object_set_new(rootJ, "pcmUnderruns", json_integer(pcmBuffer->underrunCount()));
+    json_object_set_new(rootJ, "pcmDiscarded", json_integer(pcmBuffer->discardCount()));
+  }
+  return rootJ;
+}
+
+void ProjectMRenderer::logStats() const {
+  json_t* rootJ = statsToJson();
+  char* s = json_dumps(rootJ, JSON_COMPACT);
+  if (s) {
+    rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Render stats %p: %s", (const void*)this, s);
+    free(s);
+  }
+  json_decref(rootJ);
+}
+
+std::shared_ptr<const ProjectMRenderer::State> ProjectMRenderer::getState() const {
+  return std::atomic_load(&state);
+}
+
+// True if the renderer is autoplaying presets
 bool ProjectMRenderer::isAutoplayEnabled() const {
-  std::lock_guard<std::mutex> l(pm_m);
-  if (!pm) return false;
-  return !pm->isPresetLocked();
+  return getState()->autoplay;
 }
 
 // ID of the current preset in projectM's list
 unsigned int ProjectMRenderer::activePreset() const {
-  unsigned int presetIdx;
-  std::lock_guard<std::mutex> l(pm_m);
-  if (!pm) return 0;
-  pm->selectedPresetIndex(presetIdx);
-  return presetIdx;
+  return getState()->presetIndex;
 }
 
 // Name of the preset projectM is currently displaying
 std::string ProjectMRenderer::activePresetName() const {
-  unsigned int presetIdx;
-  std::unique_lock<std::mutex> l(pm_m);
-  if (!pm) return "";
-  if (pm->selectedPresetIndex(presetIdx)) {
-    l.unlock();
-    return pm->getPresetName(presetIdx);
-  }
-  return "";
+  return getState()->presetName;
 }
 
 // Returns a list of all presets currently loaded by projectM
 std::list<std::pair<unsigned int, std::string> > ProjectMRenderer::listPresets() const {
   std::list<std::pair<unsigned int, std::string> > presets;
-  unsigned int n;
-  {
-    std::lock_guard<std::mutex> l(pm_m);
-    if (!pm) return presets;
-    n = pm->getPlaylistSize();
-  }
-  if (!n) {
-    return presets;
-  }
-  for (unsigned int i = 0; i < n; ++i){
-    std::string s;
-    {
-      std::lock_guard<std::mutex> l(pm_m);
-      s = pm->getPresetName(i);
-    }
-    presets.push_back(std::make_pair(i, std::string(s)));
+  std::shared_ptr<const State> st = getState();
+  if (!st->presetNames) return presets;
+  for (unsigned int i = 0; i < st->presetNames->size(); ++i) {
+    presets.push_back(std::make_pair(i, (*st->presetNames)[i]));
   }
   return presets;
 }
 
 bool ProjectMRenderer::isRendering() const {
-  return getStatus() == Status::RENDERING;
+  return getState()->status == Status::RENDERING;
 }
 
+bool ProjectMRenderer::isStarting() const {
+  std::shared_ptr<const State> st = getState();
+  return st->status == Status::NOT_INITIALIZED || st->status == Status::SETTINGS_SET ||
+    (st->status == Status::RENDERING && !st->rendered);
+}
 
-int ProjectMRenderer::getClearRequestedPresetID() {
-  std::lock_guard<std::mutex> l(flags_m);
-  int r = requestedPresetID;
-  requestedPresetID = kPresetIDKeep;
-  return r;
+
+float ProjectMRenderer::getRequestedFPS() const {
+  return requestedFPS.load();
 }
 
-bool ProjectMRenderer::getClearRequestedToggleAutoplay() {
-  std::lock_guard<std::mutex> l(flags_m);
-  bool r = requestedToggleAutoplay;;
-  requestedToggleAutoplay = false;
-  return r;
+bool ProjectMRenderer::getRequestedVSync() const {
+  return requestedVSync.load() && supportsVSync();
+}
+
+bool ProjectMRenderer::getRequestedDynamicResolution() const {
+  return requestedDynamicResolution.load();
+}
+
+bool ProjectMRenderer::getRequestedVisible() const {
+  return requestedVisible.load();
+}
+
+Quality ProjectMRenderer::getRequestedQuality() const {
+  return requestedQuality.load();
+}
+
+bool ProjectMRenderer::wantsDedicatedThread() const {
+  return getRequestedVSync();
 }
 
 ProjectMRenderer::Status ProjectMRenderer::getStatus() const {
-  std::lock_guard<std::mutex> l(flags_m);
-  return status;
+  return status.load();
 }
 
 void ProjectMRenderer::setStatus(Status s) {
-  std::lock_guard<std::mutex> l(flags_m);
-  status = s;
+  Status cur = status.load();
+  do {
+    if (cur == Status::PLEASE_EXIT && s != Status::EXITING) return;
+  } while (!status.compare_exchange_weak(cur, s));
 }
 
 void ProjectMRenderer::renderSetAutoplay(bool enable) {
-  std::lock_guard<std::mutex> l(pm_m);
-  pm->setPresetLock(!enable);
+  // projectM's own autoplay ignores the preset weights
+  pm->setPresetLock(true);
+  if (enable && !autoplay) nextAutoplaySwitch = renderLoopClock() + settings.presetDuration;
+  autoplay = enable;
+}
+
+double ProjectMRenderer::renderLoopClock() const {
+  return virtualTime >= 0 ? virtualTime :
+    std::chrono::duration<double>(FramePacer::Clock::now().time_since_epoch()).count();
 }
 
 // Switch to the next preset. This should be called only from the
 // render thread.
-void ProjectMRenderer::renderLoopNextPreset() {
-  std::lock_guard<std::mutex> l(pm_m);
+void ProjectMRenderer::renderLoopNextPreset(bool hardCut) {
+  renderLoopUpdateWeights();
   unsigned int n = pm->getPlaylistSize();
   if (n) {
-    pm->selectPreset(rand() % n);
+    pm->selectPreset(renderLoopPickPreset(), hardCut);
+    renderLoopPresetSwitched(hardCut);
+  }
+}
+
+// Recomputes every preset's odds of being picked when the frame
+// budget changes. This should be called only from the render thread.
+void ProjectMRenderer::renderLoopUpdateWeights() {
+  float fps = getRequestedFPS();
+  unsigned int n = pm->getPlaylistSize();
+  // GPU costs follow the size frames are actually shown at, which for
+  // a window is its framebuffer's, not the settings'
+  GLuint fbo;
+  int width, height;
+  getFrameSource(&fbo, &width, &height);
+  if (fps == weightsFPS && width == weightsWidth && height == weightsHeight && presetWeights.size() == n) return;
+  weightsFPS = fps;
+  weightsWidth = width;
+  weightsHeight = height;
+  presetWeights.assign(n, 1);
+  presetWeightSum = n;
+  if (PresetCosts::get().empty() || fps <= 0) return;
+
+  double budgetMs = 1000 / fps;
+  presetWeightSum = 0;
+  for (unsigned int i = 0; i < n; ++i) {
+    presetWeights[i] = PresetCosts::get().weight(pm->getPresetName(i), budgetMs, width, height);
+    presetWeightSum += presetWeights[i];
+  }
+}
+
+// Picks a random preset according to the weights. This should be
+// called only from the render thread.
+unsigned int ProjectMRenderer::renderLoopPickPreset() {
+  unsigned int n = presetWeights.size();
+  if (presetWeightSum <= 0) {
+    // Nothing fits the budget, better something than nothing
+    return rand() % n;
+  }
+  double x = presetWeightSum * rand() / ((double)RAND_MAX + 1);
+  for (unsigned int i = 0; i < n; ++i) {
+    x -= presetWeights[i];
+    if (x < 0) return i;
+  }
+  return n - 1;
+}
+
+void ProjectMRenderer::renderLoopPresetSwitched(bool hardCut) {
+  double now = renderLoopClock();
+  nextAutoplaySwitch = now + settings.presetDuration;
+  measureAfter = now + kPresetLoadSeconds + (hardCut ? 0 : settings.smoothPresetDuration);
+}
+
+void ProjectMRenderer::renderLoopAutoplay() {
+  if (autoplay && renderLoopClock() >= nextAutoplaySwitch) {
+    // Blended in like projectM's own timed switches
+    renderLoopNextPreset(false);
   }
 }
 
 // Switch to the indicated preset. This should be called only from
 // the render thread.
 void ProjectMRenderer::renderLoopSetPreset(unsigned int i) {
-  std::lock_guard<std::mutex> l(pm_m);
   unsigned int n = pm->getPlaylistSize();
   if (n && i < n) {
     pm->selectPreset(i);
+    renderLoopPresetSwitched(true);
   }
 }
 
-void ProjectMRenderer::renderLoop(projectM::Settings s) {
-  if (!window) {
-    setStatus(Status::FAILED);
+// Hands projectM whatever audio the engine produced since the last
+// frame. This should be called only from the render thread.
+void ProjectMRenderer::renderLoopFeedPCM() {
+  if (!pcmBuffer) return;
+  stats.recordPCMFill(pcmBuffer->size());
+  size_t n = pcmBuffer->pop(pcmScratch, kPCMFeedFrames);
+  if (!n) return;
+  // addPCMfloat_2ch counts interleaved floats, not frames
+  pm->pcm()->addPCMfloat_2ch(reinterpret_cast<const float*>(pcmScratch), 2 * n);
+}
+
+void ProjectMRenderer::renderLoopUpdateCatalog() {
+  if (published.catalog) return;
+  // Built by the first renderer on this directory, shared afterwards
+  std::shared_ptr<const PresetCatalog> catalog = PresetCatalog::tryGet(settings.presetURL);
+  if (!catalog) return;
+  catalogToPlaylist.assign(catalog->size(), -1);
+  playlistToCatalog.assign(published.presetNames->size(), -1);
+  for (unsigned int i = 0; i < playlistToCatalog.size(); ++i) {
+    size_t c = catalog->find(pm->getPresetURL(i));
+    if (c == PresetCatalog::npos) continue;
+    playlistToCatalog[i] = c;
+    catalogToPlaylist[c] = i;
+  }
+  published.catalog = catalog;
+  renderLoopPublish(true);
+}
+
+void ProjectMRenderer::renderLoopApplyCommands(bool resize) {
+  renderLoopUpdateCatalog();
+  // Resizes and preset switches are expensive, only the last one of
+  // each counts. Toggles are applied in order.
+  int presetID = kPresetIDKeep;
+  Command c;
+  while (!quitting && commands.pop(&c)) {
+    switch (c.type) {
+    case Command::SET_PRESET:
+      presetID = c.arg;
+      break;
+    case Command::SET_CATALOG_PRESET:
+      if (c.arg >= 0 && (size_t)c.arg < catalogToPlaylist.size() && catalogToPlaylist[c.arg] >= 0) {
+	presetID = catalogToPlaylist[c.arg];
+      }
+      break;
+    case Command::TOGGLE_AUTOPLAY:
+      renderSetAutoplay(!autoplay);
+      break;
+    case Command::RESIZE:
+      resize = true;
+      break;
+    case Command::QUIT:
+      // We're about to be stopped, nothing else matters
+      quitting = true;
+      return;
+    }
+  }
+
+  if (resize) renderLoopResize();
+
+  if (presetID != kPresetIDKeep) {
+    StageTimer t(stats, RenderStats::PRESET_SWITCH);
+    if (presetID == kPresetIDRandom) {
+      renderLoopNextPreset();
+    } else {
+      renderLoopSetPreset(presetID);
+    }
+  }
+}
+
+void ProjectMRenderer::renderLoopResize() {
+  StageTimer t(stats, RenderStats::RESIZE);
+  GLuint fbo;
+  int x, y;
+  getFrameSource(&fbo, &x, &y);
+  renderWidth = std::max(1, (int)(x * scaler.scale() + 0.5f));
+  renderHeight = std::max(1, (int)(y * scaler.scale() + 0.5f));
+  pm->projectM_resetGL(renderWidth, renderHeight);
+  currentRenderScale.store(scaler.scale());
+}
+
+bool ProjectMRenderer::renderLoopUpdateScale(uint64_t gpuUs) {
+  // Calibration needs frames at full size
+  if (calibrating) return false;
+  if (!getRequestedDynamicResolution()) {
+    if (scaler.scale() == 1) return false;
+    scaler.reset();
+    return true;
+  }
+  float fps = getRequestedFPS();
+  if (!gpuUs || fps <= 0) return false;
+  return scaler.frameDone(gpuUs / 1000., 1000 / fps);
+}
+
+void ProjectMRenderer::renderLoopUpscale() {
+  if (scaler.scale() >= 1) return;
+  GLuint fbo;
+  int x, y;
+  getFrameSource(&fbo, &x, &y);
+  if (renderWidth >= x && renderHeight >= y) return;
+
+  // projectM drew in the bottom left corner of the frame source. A
+  // framebuffer can't be blitted onto itself, so the corner goes
+  // through a buffer of our own, sized for the largest possible
+  // corner so scale changes don't reallocate it.
+  if (!scaleFramebuffer) {
+    glGenFramebuffers(1, &scaleFramebuffer);
+    glGenRenderbuffers(1, &scaleRenderbuffer);
+  }
+  if (scaleBufferWidth != x || scaleBufferHeight != y) {
+    glBindRenderbuffer(GL_RENDERBUFFER, scaleRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, x, y);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, scaleFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, scaleRenderbuffer);
+    scaleBufferWidth = x;
+    scaleBufferHeight = y;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, scaleFramebuffer);
+  glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, renderWidth, renderHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, scaleFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+  glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, x, y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Frames left out of the calibration, while the first preset loads
+static const int kCalibrationSkipFrames = 10;
+static const size_t kCalibrationFrames = 60;
+
+// Under QUALITY_AUTO, once calibrated, a tier is dropped when the CPU
+// side of renderFrame() averages more than kCPUOverload of the frame
+// budget. Most of it is projectM evaluating the preset's per-vertex
+// equations, which scales with the mesh. The average spans about
+// kCPULoadFrames frames, and a tier is kept at least three times
+// that long. A dropped tier is stepped back up, at most to the
+// calibrated one, once the load scaled to the next tier's mesh has
+// stayed under kCPUUnderload for kStepUpFrames. Frames that load a
+// preset or blend two aren't measured, they're heavier than either
+// preset alone.
+static const double kCPUOverload = 0.8;
+static const double kCPUUnderload = 0.5;
+static const int kCPULoadFrames = 60;
+static const int kStepUpFrames = 10 * kCPULoadFrames;
+
+static uint64_t median(std::vector<uint64_t>& v) {
+  if (v.empty()) return 0;
+  std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+  return v[v.size() / 2];
+}
+
+void ProjectMRenderer::renderLoopUpdateQuality(uint64_t gpuUs) {
+  Quality requested = getRequestedQuality();
+  if (requested != qualitySetting) {
+    qualitySetting = requested;
+    calibrating = requested == QUALITY_AUTO;
+    calibrationFrames = 0;
+    calibrationCPU.clear();
+    calibrationGPU.clear();
+    if (!calibrating && requested != QUALITY_CUSTOM && requested != qualityLevel) {
+      renderLoopSetQuality(requested);
+    }
+    return;
+  }
+  if (!calibrating) {
+    renderLoopCheckCPULoad();
+    return;
+  }
+  if (++calibrationFrames <= kCalibrationSkipFrames) return;
+  // Both lag the frame they measure, the GPU one by a few frames
+  calibrationCPU.push_back(lastRenderUs);
+  if (gpuUs) calibrationGPU.push_back(gpuUs);
+  if (calibrationCPU.size() < kCalibrationFrames) return;
+
+  calibrating = false;
+  float fps = getRequestedFPS();
+  double cpuMs = median(calibrationCPU) / 1000.;
+  double gpuMs = median(calibrationGPU) / 1000.;
+  Quality q = calibrateQuality(settings, cpuMs, gpuMs, fps > 0 ? 1000 / fps : 1000 / 60.);
+  rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Calibrated quality %s (%.2f ms CPU, %.2f ms GPU per frame at %dx%d mesh, %d texture)",
+		  qualityName(q), cpuMs, gpuMs, settings.meshX, settings.meshY, settings.textureSize);
+  calibratedLevel = q;
+  if (q != qualityLevel) {
+    renderLoopSetQuality(q);
+  } else {
+    currentQuality.store(q);
+  }
+}
+
+void ProjectMRenderer::renderLoopCheckCPULoad() {
+  if (qualitySetting != QUALITY_AUTO || renderLoopClock() < measureAfter) return;
+  float fps = getRequestedFPS();
+  double budgetUs = 1e6 / (fps > 0 ? fps : 60);
+  // Starts from the first frame measured rather than from 0
+  cpuLoad = framesAtQuality ? cpuLoad + (lastRenderUs / budgetUs - cpuLoad) / kCPULoadFrames : lastRenderUs / budgetUs;
+  if (++framesAtQuality < 3 * kCPULoadFrames) return;
+
+  if (cpuLoad >= kCPUOverload && qualityLevel > QUALITY_LOW) {
+    Quality q = (Quality)(qualityLevel - 1);
+    rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Lowering quality to %s, rendering takes %.0f%% of the frame budget on the CPU at %dx%d mesh",
+		    qualityName(q), cpuLoad * 100, settings.meshX, settings.meshY);
+    renderLoopSetQuality(q);
     return;
   }
-  glfwMakeContextCurrent(window);
-  logContextInfo("Milkrack window", window);
-  
-  // Initialize projectM
+
+  if (qualityLevel >= calibratedLevel) return;
+  Quality q = (Quality)(qualityLevel + 1);
+  projectM::Settings next = settings;
+  applyQuality(q, &next);
+  double predicted = cpuLoad * (next.meshX * next.meshY) / (settings.meshX * settings.meshY);
+  framesUnderLoad = predicted < kCPUUnderload ? framesUnderLoad + 1 : 0;
+  if (framesUnderLoad < kStepUpFrames) return;
+  rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Raising quality to %s, rendering takes %.0f%% of the frame budget on the CPU at %dx%d mesh",
+		  qualityName(q), cpuLoad * 100, settings.meshX, settings.meshY);
+  renderLoopSetQuality(q);
+}
+
+void ProjectMRenderer::renderLoopSetQuality(Quality q) {
+  // Mesh and texture sizes are only read when projectM is built
+  applyQuality(q, &settings);
+  renderLoopRebuild();
+  qualityLevel = q;
+  currentQuality.store(q);
+  cpuLoad = 0;
+  framesAtQuality = 0;
+  framesUnderLoad = 0;
+}
+
+void ProjectMRenderer::renderLoopUpdateFrameSize() {
+  int width = settings.windowWidth, height = settings.windowHeight;
+  extraProjectMFrameSize(&width, &height);
+  if (width == settings.windowWidth && height == settings.windowHeight) return;
+  rack::loggerLog(rack::INFO_LEVEL, "Milkrack/" __FILE__, __LINE__, "Drawing frames at %dx%d", width, height);
+  // So is the frame size
+  settings.windowWidth = width;
+  settings.windowHeight = height;
+  renderLoopRebuild();
+}
+
+void ProjectMRenderer::renderLoopRebuild() {
+  StageTimer t(stats, RenderStats::RESIZE);
+  unsigned int preset;
+  bool hasPreset = pm->selectedPresetIndex(preset);
+  delete pm;
+  renderLoopCreateProjectM();
+  // The frame size or the quality changed, weights are recomputed on
+  // the next pick
+  weightsFPS = 0;
+
+  // Locks the new projectM's playlist
+  renderSetAutoplay(autoplay);
+  if (hasPreset) {
+    pm->selectPreset(preset);
+    measureAfter = renderLoopClock() + kPresetLoadSeconds;
+  } else {
+    renderLoopNextPreset();
+  }
+  renderLoopResize();
+}
+
+void ProjectMRenderer::renderLoopCreateProjectM() {
+  pm = new projectM(settings);
+  extraProjectMInitialization();
+}
+
+void ProjectMRenderer::renderLoopPublish(bool force) {
+  State next = published;
+  next.status = getStatus();
+  next.hasPreset = pm && pm->selectedPresetIndex(next.presetIndex);
+  if (!next.hasPreset) next.presetIndex = 0;
+  next.catalogIndex = next.hasPreset && next.presetIndex < playlistToCatalog.size() ? playlistToCatalog[next.presetIndex] : -1;
+  next.autoplay = pm && autoplay;
+  next.rendered = hasRendered;
+  if (!force && next.status == published.status && next.hasPreset == published.hasPreset &&
+      next.presetIndex == published.presetIndex && next.autoplay == published.autoplay &&
+      next.rendered == published.rendered) {
+    return;
+  }
+  if (next.hasPreset && (!published.hasPreset || next.presetIndex != published.presetIndex)) {
+    next.presetName = pm->getPresetName(next.presetIndex);
+  } else if (!next.hasPreset) {
+    next.presetName.clear();
+  }
+  published = next;
+  std::atomic_store(&state, std::shared_ptr<const State>(std::make_shared<State>(next)));
+}
+
+void ProjectMRenderer::renderLoopCapture() {
+  std::shared_ptr<FrameCapture> c;
+  bool replace = false;
   {
-    std::lock_guard<std::mutex> l(pm_m);
-    pm = new projectM(s);
-    extraProjectMInitialization();
+    std::lock_guard<std::mutex> l(flags_m);
+    if (captureRequested) {
+      c.swap(requestedCapture);
+      captureRequested = false;
+      replace = true;
+    }
+  }
+  if (replace) {
+    // The old capture's GL objects belong to this context, free them
+    // before letting go
+    if (capture) capture->releaseGL();
+    capture.swap(c);
+    // Its writer may still be busy with the output
+    FrameCapture::dispose(std::move(c));
   }
-  
+  if (!capture) return;
+  GLuint fbo;
+  int x, y;
+  getFrameSource(&fbo, &x, &y);
+  capture->captureFrame(renderLoopClock(), fbo, x, y);
+}
+
+bool ProjectMRenderer::renderLoopStart() {
+  if (!contextHandle()) {
+    setStatus(Status::FAILED);
+    renderLoopPublish();
+    return false;
+  }
+  if (window) logContextInfo("Milkrack window", window);
+  // Pacing is done by renderLoopSchedule(), don't let the driver add
+  // its own wait on top of it.
+  setSwapInterval(0);
+  vsyncActive = false;
+
+  // Initialize projectM. QUALITY_AUTO calibrates from medium.
+  qualitySetting = getRequestedQuality();
+  qualityLevel = qualitySetting == QUALITY_AUTO ? QUALITY_MEDIUM : qualitySetting;
+  applyQuality(qualityLevel, &settings);
+  currentQuality.store(qualitySetting == QUALITY_AUTO ? QUALITY_CUSTOM : qualityLevel);
+  calibrating = qualitySetting == QUALITY_AUTO;
+  calibrationFrames = 0;
+  calibrationCPU.clear();
+  calibrationGPU.clear();
+  renderLoopCreateProjectM();
+  gpuTimer.initGL();
+
+  // The playlist doesn't change after this, publish it once
+  std::shared_ptr<std::vector<std::string> > names = std::make_shared<std::vector<std::string> >();
+  for (unsigned int i = 0, n = pm->getPlaylistSize(); i < n; ++i) {
+    names->push_back(pm->getPresetName(i));
+  }
+  published.presetNames = names;
+
+  renderWidth = settings.windowWidth;
+  renderHeight = settings.windowHeight;
+  scaler.reset();
+  currentRenderScale.store(1);
+
   setStatus(Status::RENDERING);
   renderSetAutoplay(false);
   renderLoopNextPreset();
-  
-  while (true) {
-    {
-      // Did the main thread request that we exit?
-      if (getStatus() == Status::PLEASE_EXIT) {
-	break;
-      }
-      
-      // Resize?
-      if (dirtySize) {
-	int x, y;
-	glfwGetFramebufferSize(window, &x, &y);
-	pm->projectM_resetGL(x, y);
-	dirtySize = false;
-      }
-      
-      {
-	// Did the main thread request an autoplay toggle?
-	if (getClearRequestedToggleAutoplay()) {
-	  renderSetAutoplay(!isAutoplayEnabled());
-	}
-	
-	// Did the main thread request that we change the preset?
-	int rpid = getClearRequestedPresetID();
-	if (rpid != kPresetIDKeep) {
-	  if (rpid == kPresetIDRandom) {
-	    renderLoopNextPreset();
-	  } else {
-	    renderLoopSetPreset(rpid);
-	  }
-	}
-      }
-      
-      {
-	std::lock_guard<std::mutex> l(pm_m);
-	pm->renderFrame();
-      }
-      glfwSwapBuffers(window);
-    }
-    usleep(1000000/60); // TODO fps
+  renderLoopPublish(true);
+  pacer.reset();
+  return true;
+}
+
+bool ProjectMRenderer::renderLoopIdle() {
+  bool wasHidden = hidden;
+  // The first frame is always rendered, until then the UI shows
+  // "Starting..."
+  hidden = hasRendered && !getRequestedVisible() && !isCapturing();
+  if (!hidden) {
+    // Hidden ticks are off the pacer's schedule, start a new one
+    if (wasHidden) pacer.reset();
+    hiddenTicks = 0;
+    return false;
   }
+  if (hiddenTicks++ % kHiddenFrameTicks == 0) return false;
+  renderLoopApplyCommands(false);
+  renderLoopFeedPCM();
+  renderLoopPublish();
+  return true;
+}
 
+void ProjectMRenderer::renderLoopStep() {
+  if (renderLoopIdle()) return;
+  stats.applyReset();
+  uint64_t gpuUs = gpuTimer.collect(stats);
+  StageTimer frameTimer(stats, RenderStats::FRAME);
+
+  renderLoopUpdateFrameSize();
+  renderLoopUpdateQuality(gpuUs);
+  renderLoopApplyCommands(renderLoopUpdateScale(gpuUs));
+  renderLoopFeedPCM();
+
+  {
+    StageTimer t(stats, RenderStats::RENDER);
+    gpuTimer.begin();
+    pm->renderFrame();
+    gpuTimer.end();
+    lastRenderUs = t.elapsedMicroseconds();
+  }
+  hasRendered = true;
+  renderLoopUpscale();
+  renderLoopAutoplay();
+  renderLoopPublish();
+  renderLoopCapture();
+  extraProjectMFrameRendered();
   {
-    std::lock_guard<std::mutex> l(pm_m);
-    delete pm;
-    pm = nullptr;
+    StageTimer t(stats, RenderStats::SWAP);
+    swapBuffers();
+  }
+}
+
+FramePacer::Clock::time_point ProjectMRenderer::renderLoopSchedule(FramePacer::Clock::time_point now) {
+  if (hidden) return now + kHiddenTick;
+  bool vsync = getRequestedVSync();
+  if (vsync != vsyncActive) {
+    setSwapInterval(vsync ? 1 : 0);
+    vsyncActive = vsync;
+    pacer.reset();
+  }
+  if (vsyncActive) {
+    // swapBuffers() already blocked until the next refresh
+    return now;
+  }
+  float fps = getRequestedFPS();
+  if (fps != pacer.targetFPS()) {
+    pacer.setTargetFPS(fps);
+  }
+  return pacer.frameDone(now);
+}
+
+void ProjectMRenderer::renderLoopStop() {
+  if (capture) {
+    capture->releaseGL();
+    FrameCapture::dispose(std::move(capture));
+  }
+  gpuTimer.releaseGL();
+  if (scaleFramebuffer) {
+    glDeleteFramebuffers(1, &scaleFramebuffer);
+    glDeleteRenderbuffers(1, &scaleRenderbuffer);
+    scaleFramebuffer = scaleRenderbuffer = 0;
+    scaleBufferWidth = scaleBufferHeight = 0;
   }
+  extraProjectMCleanup();
+  delete pm;
+  pm = nullptr;
   glFinish(); // Finish any pending OpenGL operations
   setStatus(Status::EXITING);
+  renderLoopPublish();
 }
 
 void ProjectMRenderer::logContextInfo(std::string name, GLFWwindow* w) const {
@@ -244,6 +791,9 @@ GLFWwindow* WindowedRenderer::createWindow() {
   glfwSetWindowUserPointer(c, reinterpret_cast<void*>(this));
   glfwSetFramebufferSizeCallback(c, framebufferSizeCallback);
   glfwSetWindowCloseCallback(c, [](GLFWwindow* w) { glfwIconifyWindow(w); });
+  glfwSetWindowIconifyCallback(c, [](GLFWwindow* w, int iconified) {
+    reinterpret_cast<WindowedRenderer*>(glfwGetWindowUserPointer(w))->setVisible(!iconified);
+  });
   glfwSetKeyCallback(c, keyCallback);
   glfwSetWindowTitle(c, u8"Milkrack");
   return c;
@@ -251,7 +801,7 @@ GLFWwindow* WindowedRenderer::createWindow() {
 
 void WindowedRenderer::framebufferSizeCallback(GLFWwindow* win, int x, int y) {
   WindowedRenderer* r = reinterpret_cast<WindowedRenderer*>(glfwGetWindowUserPointer(win));
-  r->dirtySize = true;
+  r->requestResize();
 }
 
 
@@ -315,8 +865,169 @@ GLFWwindow* TextureRenderer::createWindow() {
 
 void TextureRenderer::extraProjectMInitialization() {
   texture = pm->initRenderToTexture();
+  textureWidth = pm->settings().windowWidth;
+  textureHeight = pm->settings().windowHeight;
+
+  // projectM is rebuilt when the quality or the frame size changes.
+  // The frame textures stay, the UI keeps handles to them, and may be
+  // sampling one right now: each is resized by
+  // extraProjectMFrameRendered() when it's next written to.
+  if (!readFramebuffer) {
+    glGenTextures(kFrameSlots, frameTextures);
+    glGenFramebuffers(1, &readFramebuffer);
+    glGenFramebuffers(1, &drawFramebuffer);
+    for (int i = 0; i < kFrameSlots; ++i) {
+      glBindTexture(GL_TEXTURE_2D, frameTextures[i]);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void TextureRenderer::extraProjectMFrameRendered() {
+  updateSinks();
+  int slot = frames.writeSlot();
+  // The UI never holds the write slot, so its storage can be
+  // respecified here. Its size always matches its storage.
+  if (frameWidths[slot] != textureWidth || frameHeights[slot] != textureHeight) {
+    glBindTexture(GL_TEXTURE_2D, frameTextures[slot]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, textureWidth, textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    frameWidths[slot] = textureWidth;
+    frameHeights[slot] = textureHeight;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+  glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, frameTextures[slot], 0);
+  glBlitFramebuffer(0, 0, textureWidth, textureHeight, 0, 0, textureWidth, textureHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  // Each output gets a copy of its own, for its window to read
+  // whenever it's ready
+  for (std::shared_ptr<FrameSink> const& s : sinks) {
+    s->copyFrame(readFramebuffer, drawFramebuffer, textureWidth, textureHeight);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  // The slot is published right away, with a fence the readers wait
+  // on in their own context before sampling it, so that they never
+  // see a half-copied frame. Waiting for it here would hold up every
+  // other renderer on this thread until the GPU is done.
+  if (frameFences[slot]) glDeleteSync(frameFences[slot]);
+  frameFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // Other contexts only see the fence once it reaches the GPU
+  glFlush();
+  frames.publish();
+  for (std::shared_ptr<FrameSink> const& s : sinks) {
+    s->publish();
+  }
+}
+
+// Frames drawn for output windows are at most this wide or high
+static const int kMaxFrameSize = 4096;
+// How long an output window must keep its size before frames are
+// drawn at it
+static const std::chrono::milliseconds kFrameResizeDelay(500);
+
+void TextureRenderer::extraProjectMFrameSize(int* width, int* height) {
+  if (!panelWidth) {
+    panelWidth = *width;
+    panelHeight = *height;
+  }
+  // While output windows are open, frames are drawn for the largest
+  // one, and scaled down for the panel
+  int w = panelWidth, h = panelHeight;
+  for (std::shared_ptr<FrameSink> const& s : sinks) {
+    int sw, sh;
+    s->getFramebufferSize(&sw, &sh);
+    if ((long)sw * sh > (long)w * h) {
+      w = sw;
+      h = sh;
+    }
+  }
+  if (w > kMaxFrameSize || h > kMaxFrameSize) {
+    float scale = (float)kMaxFrameSize / std::max(w, h);
+    w = std::max(1, (int)(w * scale));
+    h = std::max(1, (int)(h * scale));
+  }
+  FramePacer::Clock::time_point now = FramePacer::Clock::now();
+  if (w != wantedWidth || h != wantedHeight) {
+    wantedWidth = w;
+    wantedHeight = h;
+    wantedSince = now;
+  }
+  // A window being resized goes through many sizes, projectM is only
+  // rebuilt once one sticks
+  if (now - wantedSince >= kFrameResizeDelay) {
+    *width = w;
+    *height = h;
+  }
+}
+
+void TextureRenderer::addSink(std::shared_ptr<FrameSink> sink) {
+  std::lock_guard<std::mutex> l(sinks_m);
+  addedSinks.push_back(sink);
+}
+
+void TextureRenderer::updateSinks() {
+  {
+    std::lock_guard<std::mutex> l(sinks_m);
+    sinks.insert(sinks.end(), addedSinks.begin(), addedSinks.end());
+    addedSinks.clear();
+  }
+  for (auto it = sinks.begin(); it != sinks.end();) {
+    if ((*it)->isClosed()) {
+      // The window is gone, its textures are ours to free
+      (*it)->releaseGL();
+      it = sinks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void TextureRenderer::getFrameSource(GLuint* fbo, int* x, int* y) {
+  *fbo = readFramebuffer;
+  *x = textureWidth;
+  *y = textureHeight;
+}
+
+void TextureRenderer::extraProjectMCleanup() {
+  glDeleteFramebuffers(1, &readFramebuffer);
+  glDeleteFramebuffers(1, &drawFramebuffer);
+  glDeleteTextures(kFrameSlots, frameTextures);
+  readFramebuffer = drawFramebuffer = 0;
+  for (int i = 0; i < kFrameSlots; ++i) {
+    frameWidths[i] = frameHeights[i] = 0;
+    if (frameFences[i]) glDeleteSync(frameFences[i]);
+    frameFences[i] = nullptr;
+  }
+  for (std::shared_ptr<FrameSink> const& s : sinks) {
+    s->releaseGL();
+  }
+  sinks.clear();
+}
+
+int TextureRenderer::acquireLatestFrame() {
+  if (frames.acquire()) {
+    hasFrame = true;
+    // Queues the wait on the GPU, draw() doesn't block
+    GLsync fence = frameFences[frames.readSlot()];
+    if (fence) glWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+  }
+  return hasFrame ? frames.readSlot() : -1;
+}
+
+GLuint TextureRenderer::getFrameTexture(int slot) const {
+  return frameTextures[slot];
 }
 
-int TextureRenderer::getTextureID() const {
-  return texture;
+void TextureRenderer::getFrameSize(int slot, int* width, int* height) const {
+  *width = frameWidths[slot];
+  *height = frameHeights[slot];
 }
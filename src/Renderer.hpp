@@ -4,15 +4,35 @@
 
 #include "GLFW/glfw3.h"
 #include "deps/projectm/src/libprojectM/projectM.hpp"
+#include "PCMBuffer.hpp"
+#include "TripleBuffer.hpp"
+#include "FramePacer.hpp"
+#include "FrameCapture.hpp"
+#include "FrameSink.hpp"
+#include "RenderStats.hpp"
+#include "MPSCQueue.hpp"
+#include "ResolutionScaler.hpp"
+#include "Quality.hpp"
+#include "PresetCatalog.hpp"
+#include <atomic>
 #include <list>
-#include <thread>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
 // Special values for preset requests
 static const int kPresetIDRandom = -1; // Switch to a random preset
 static const int kPresetIDKeep = -2; // Keep the current preset
 
+class RenderWorker;
+class OfflineRenderer;
+
 class ProjectMRenderer {
+  friend class RenderService;
+  friend class RenderWorker;
+  friend class OfflineRenderer;
+
 public:
   enum Status {
     NOT_INITIALIZED,
@@ -23,42 +43,255 @@ public:
     EXITING
   };
 
+  // What the render thread last published about itself. A published
+  // State is never modified, readers on any thread may keep it as
+  // long as they like.
+  struct State {
+    Status status = Status::NOT_INITIALIZED;
+    bool hasPreset = false; // False until projectM selected a preset
+    unsigned int presetIndex = 0;
+    std::string presetName;
+    bool autoplay = false;
+    bool rendered = false; // True once a frame was rendered
+    // Names of all presets in projectM's list, by index
+    std::shared_ptr<const std::vector<std::string> > presetNames;
+    // The presets of the directory projectM loaded, null until it's
+    // cataloged, and the current one's index in it or -1
+    std::shared_ptr<const PresetCatalog> catalog;
+    int catalogIndex = -1;
+  };
+
 private:
-  GLFWwindow* window;
-  std::thread renderThread;
-  Status status = Status::NOT_INITIALIZED;
-  int requestedPresetID = kPresetIDKeep; // Indicates to the render thread that it should switch to the specified preset
-  bool requestedToggleAutoplay = false;
+  // Requests from other threads, applied by the render thread at the
+  // start of the next frame.
+  struct Command {
+    enum Type {
+      SET_PRESET, // arg is a preset ID or kPresetIDRandom
+      SET_CATALOG_PRESET, // arg is an index in the published catalog
+      TOGGLE_AUTOPLAY,
+      RESIZE,
+      QUIT
+    };
+    Type type;
+    int arg;
+  };
+
+
+  GLFWwindow* window = nullptr;
+  bool ownsWindow = true; // False if the context is shared with other renderers
+  RenderWorker* worker = nullptr; // Guarded by RenderService's lock
+  // Worker whose shared context we render in, if any. Guarded by
+  // RenderService's lock.
+  RenderWorker* sharedWith = nullptr;
+  // Render thread only
+  bool started = false;
+  FramePacer::Clock::time_point nextFrameDue;
+  bool quitting = false;
+  bool hasRendered = false;
+  State published; // Copy of the latest published state
+
+  MPSCQueue<Command, 64> commands;
+  // Read and written through std::atomic_load/std::atomic_store only
+  std::shared_ptr<const State> state;
+  std::atomic<Status> status{Status::NOT_INITIALIZED};
+  std::atomic<float> requestedFPS{60};
+  std::atomic<bool> requestedVSync{false};
+  std::atomic<bool> requestedDynamicResolution{false};
+  std::atomic<bool> requestedVisible{true};
+  std::atomic<float> currentRenderScale{1};
+  std::atomic<Quality> requestedQuality{QUALITY_CUSTOM};
+  std::atomic<Quality> currentQuality{QUALITY_CUSTOM};
+
+  // Guarded by flags_m
+  std::shared_ptr<FrameCapture> requestedCapture;
+  bool captureRequested = false; // requestedCapture replaces the current capture, even if null
+  bool capturing = false;
+
+  // Autoplay is driven from here rather than by projectM, whose
+  // playlist stays locked, so that every switch goes through
+  // renderLoopNextPreset() and its weights. Render thread only.
+  bool autoplay = false;
+  double nextAutoplaySwitch = 0; // On renderLoopClock()
+  // Odds of each preset being picked at random, from PresetCosts and
+  // the frame budget and size they were computed for. Render thread
+  // only.
+  std::vector<double> presetWeights;
+  double presetWeightSum = 0;
+  float weightsFPS = 0;
+  int weightsWidth = 0, weightsHeight = 0;
+  // Between projectM's playlist and the published catalog, -1 where
+  // one has a preset the other doesn't. Render thread only.
+  std::vector<int> playlistToCatalog, catalogToPlaylist;
+
+  FramePacer pacer;
+  bool vsyncActive = false;
+  // Set while the output can't be seen and only the occasional tick
+  // renders a frame. Render thread only.
+  bool hidden = false;
+  int hiddenTicks = 0;
+
+  // Size projectM draws at, scaled down from the frame's size when the
+  // GPU can't keep up. Render thread only.
+  ResolutionScaler scaler;
+  int renderWidth = 0, renderHeight = 0;
+  // Holds the scaled down frame while it's stretched back over the
+  // frame source. Render thread only.
+  GLuint scaleFramebuffer = 0, scaleRenderbuffer = 0;
+  int scaleBufferWidth = 0, scaleBufferHeight = 0;
+
+  // The tier asked for, and the one settings currently hold, which
+  // differ while QUALITY_AUTO calibrates. Render thread only.
+  Quality qualitySetting = QUALITY_CUSTOM;
+  Quality qualityLevel = QUALITY_CUSTOM;
+  // Frame times sampled for QUALITY_AUTO, in microseconds. Render
+  // thread only.
+  bool calibrating = false;
+  int calibrationFrames = 0;
+  std::vector<uint64_t> calibrationCPU, calibrationGPU;
+  uint64_t lastRenderUs = 0;
+  // Share of the frame budget renderFrame() takes on the CPU, averaged,
+  // and frames measured since the tier last changed and since the load
+  // was last low enough to step up. Render thread only.
+  double cpuLoad = 0;
+  int framesAtQuality = 0;
+  int framesUnderLoad = 0;
+  // The tier calibration picked, which QUALITY_AUTO steps back up to
+  // at most. Render thread only.
+  Quality calibratedLevel = QUALITY_CUSTOM;
+  // Frames before this time, on renderLoopClock(), load or blend
+  // presets and aren't measured. Render thread only.
+  double measureAfter = 0;
+
+  std::shared_ptr<FrameCapture> capture; // Render thread only
+  // Seconds on the capture clock. Negative when frames are captured
+  // in real time. Render thread only.
+  double virtualTime = -1;
+
+  RenderStats stats;
+  GPUTimer gpuTimer; // Render thread only
+
+  // Audio coming straight from the engine thread, drained once per
+  // frame by the render thread.
+  std::shared_ptr<PCMBuffer> pcmBuffer;
+  // projectM's PCM history holds 2048 frames, anything more per
+  // render pass would just be overwritten.
+  static const size_t kPCMFeedFrames = 2048;
+  StereoFrame pcmScratch[kPCMFeedFrames];
 
-  mutable std::mutex pm_m;
   mutable std::mutex flags_m;
 
 protected:
-  projectM* pm = nullptr;
-  bool dirtySize = false;
+  projectM::Settings settings;
+  projectM* pm = nullptr; // Render thread only
 
 public:
-  ProjectMRenderer() {}
+  ProjectMRenderer() : state(std::make_shared<State>()) {}
 
-  // init creates the OpenGL context to render in, in the main thread,
-  // then starts the rendering thread. This can't be done in the ctor
-  // because creating the window calls out to virtual methods.
-  void init(projectM::Settings const& s);
+  // init hands the renderer to the RenderService, which creates or
+  // picks the OpenGL context to render in, in the main thread, and
+  // schedules it on one of its render threads, where it will consume
+  // audio from pcm. This can't be done in the ctor because creating
+  // the window calls out to virtual methods. init returns at once,
+  // the context is created by a later RenderService::pump().
+  void init(projectM::Settings const& s, std::shared_ptr<PCMBuffer> pcm);
 
-  // The dtor signals the rendering thread to terminate, then waits
-  // for it to do so. It then deletes the OpenGL context in the main
-  // thread.
-  virtual ~ProjectMRenderer();
+  // shutdown asks the RenderService to stop rendering this instance,
+  // and waits for it to do so. The OpenGL context is then released in
+  // the main thread. Subclasses must call it from their dtor, since
+  // the render thread calls their overrides until it returns. It is
+  // safe to call more than once.
+  void shutdown();
+
+  // Hands the renderer to the RenderService, which stops it and
+  // deletes it later, see RenderService::retire(). Returns at once.
+  // The renderer must not be used afterwards. Main thread only.
+  void retire();
 
-  // Sends PCM data to projectM
-  void addPCMData(float* data, unsigned int nsamples);
+  virtual ~ProjectMRenderer();
 
   // Requests that projectM changes the preset at the next opportunity
   void requestPresetID(int id);
 
+  // Requests that projectM switches to preset i of State::catalog
+  void requestCatalogPreset(size_t i);
+
   // Requests that projectM changes the autoplay status
   void requestToggleAutoplay();
 
+  // Requests that projectM adapts to the framebuffer's new size
+  void requestResize();
+
+  // Sets the frame rate the render thread aims for
+  void setTargetFPS(float fps);
+
+  // Requests that frames be paced by the display's refresh instead of
+  // the target frame rate. Ignored by renderers that don't present to
+  // a visible window.
+  void setVSync(bool enable);
+
+  // Lets the render thread lower the resolution projectM draws at
+  // while frames take more GPU time than the target frame rate
+  // allows. Frames are stretched back to full size.
+  void setDynamicResolution(bool enable);
+
+  // Tells the renderer whether its output can be seen. While it
+  // can't, and nothing is being captured, it keeps taking audio and
+  // commands but renders only about one frame a second. It catches
+  // up as soon as it's visible again.
+  void setVisible(bool visible);
+
+  // Fraction of the full frame size currently drawn, per side
+  float renderScale() const { return currentRenderScale.load(); }
+
+  // Switches projectM's mesh size, texture size and blend time to
+  // tier q. Set before init() to start with it. QUALITY_CUSTOM, the
+  // default, keeps the settings given to init().
+  void setQuality(Quality q);
+
+  // The tier the settings currently hold. While QUALITY_AUTO
+  // calibrates, and with QUALITY_CUSTOM, that's QUALITY_CUSTOM.
+  Quality activeQuality() const { return currentQuality.load(); }
+
+  // Starts streaming frames as described by s, replacing any capture
+  // already running. The output is opened on a thread of its own.
+  void startCapture(CaptureSettings const& s);
+
+  // Stops streaming frames. Frames already read back are still
+  // written out.
+  void stopCapture();
+
+  // True if a capture was started and not stopped
+  bool isCapturing() const;
+
+  // True if setVSync() has any effect on this renderer
+  virtual bool supportsVSync() const { return false; }
+
+  // True if this renderer's frames can be shown in FrameSinks
+  virtual bool supportsSinks() const { return false; }
+
+  // True if this renderer can draw in a context shared with other
+  // instances of the same kind, instead of creating its own.
+  virtual bool canShareContext() const { return false; }
+
+  // Number of frames dropped because the renderer fell behind
+  uint64_t skippedFrames() const;
+
+  // Per-stage timings of the render loop
+  RenderStats const& getStats() const { return stats; }
+
+  // Clears the timings, from the next frame on
+  void resetStats() { stats.requestReset(); }
+
+  // The timings plus PCM and pacing counters, as a JSON object owned
+  // by the caller
+  json_t* statsToJson() const;
+
+  // Writes statsToJson() to the Rack log
+  void logStats() const;
+
+  // The latest published state. Never null. Any thread.
+  std::shared_ptr<const State> getState() const;
+
   // True if projectM is autoplaying presets
   bool isAutoplayEnabled() const;
 
@@ -74,28 +307,148 @@ public:
   // True if the renderer is currently able to render projectM images
   bool isRendering() const;
 
+  // True until the first frame is rendered, unless rendering failed
+  bool isStarting() const;
+
 protected:
+  // Called on the render thread after projectM is created, which
+  // happens again when the quality tier or the frame size changes.
   virtual void extraProjectMInitialization() {}
+  // Called on the render thread before each frame with the size
+  // projectM draws at, which may be changed. projectM is then rebuilt
+  // at the new size.
+  virtual void extraProjectMFrameSize(int* width, int* height) {}
+  // Called on the render thread after each frame is rendered, and
+  // before projectM is destroyed, with the context current.
+  virtual void extraProjectMFrameRendered() {}
+  virtual void extraProjectMCleanup() {}
+  // Presents the finished frame. Render thread only.
+  virtual void swapBuffers() { glfwSwapBuffers(window); }
+
+  // Context management. The defaults work on the GLFW window returned
+  // by createWindow(), renderers that render elsewhere override
+  // them. createContext() and destroyContext() are called from the
+  // main thread, the others from the render thread.
+  virtual bool createContext() {
+    window = createWindow();
+    return window != nullptr;
+  }
+  virtual void destroyContext() {
+    glfwDestroyWindow(window);
+    window = nullptr;
+  }
+  // Identifies the context, renderers sharing one return the same
+  // handle. Null if there is no usable context.
+  virtual const void* contextHandle() const { return window; }
+  virtual void makeContextCurrent() { glfwMakeContextCurrent(window); }
+  virtual void releaseContext() { glfwMakeContextCurrent(nullptr); }
+  virtual void setSwapInterval(int interval) { glfwSwapInterval(interval); }
+  virtual void getFramebufferSize(int* x, int* y) { glfwGetFramebufferSize(window, x, y); }
+  // Framebuffer holding the finished frame, and its size. Render
+  // thread only.
+  virtual void getFrameSource(GLuint* fbo, int* x, int* y) {
+    *fbo = 0;
+    getFramebufferSize(x, y);
+  }
 
   static void logGLFWError(int errcode, const char* errmsg);
   void logContextInfo(std::string name, GLFWwindow* w) const;
 private:
-  int getClearRequestedPresetID();
-  bool getClearRequestedToggleAutoplay();
+  // Queues c for the render thread. Returns false if the queue is
+  // full, in which case c is dropped.
+  bool sendCommand(Command::Type type, int arg = 0);
+  // Tells the render thread we're going away. Any thread.
+  void requestExit();
+  float getRequestedFPS() const;
+  bool getRequestedVSync() const;
+  bool getRequestedDynamicResolution() const;
+  bool getRequestedVisible() const;
+  Quality getRequestedQuality() const;
+  // True if the renderer should get a render thread of its own,
+  // because presenting a frame blocks on the display.
+  bool wantsDedicatedThread() const;
   Status getStatus() const;
+  // Moves to status s, unless the renderer was asked to exit, in which
+  // case only EXITING is accepted.
   void setStatus(Status s);
   void renderSetAutoplay(bool enable); // TODO rename this method and other render* methods
   // Switch to the indicated preset. This should be called only from
   // the render thread.
   void renderLoopSetPreset(unsigned int i);
-  void renderLoopNextPreset();
-  void renderLoop(projectM::Settings s);
-  virtual GLFWwindow* createWindow() = 0;
+  void renderLoopNextPreset(bool hardCut = true);
+  void renderLoopUpdateWeights();
+  unsigned int renderLoopPickPreset();
+  // Soft cuts to the next preset once the current one has played for
+  // settings.presetDuration. Render thread only.
+  void renderLoopAutoplay();
+  // Restarts the autoplay timer, and leaves the frames that load the
+  // new preset, and blend into it unless hardCut, out of the CPU load
+  // measurement. Render thread only.
+  void renderLoopPresetSwitched(bool hardCut);
+  // Seconds, on the capture clock while there is one. Render thread
+  // only.
+  double renderLoopClock() const;
+  // Maps projectM's playlist to the preset catalog and publishes it,
+  // once PresetCatalog has built it. Render thread only.
+  void renderLoopUpdateCatalog();
+  // Applies the queued commands. projectM is resized if asked to, or
+  // if resize is set. Render thread only.
+  void renderLoopApplyCommands(bool resize);
+  // Resizes projectM to the frame source's size times the current
+  // scale. Render thread only.
+  void renderLoopResize();
+  // Feeds the GPU time of a frame to the scaler. Returns true if the
+  // scale changed. Render thread only.
+  bool renderLoopUpdateScale(uint64_t gpuUs);
+  // Stretches a scaled down frame over the whole frame source. Render
+  // thread only.
+  void renderLoopUpscale();
+  // Follows quality requests and runs QUALITY_AUTO's calibration.
+  // Render thread only.
+  void renderLoopUpdateQuality(uint64_t gpuUs);
+  // Drops a tier under QUALITY_AUTO when evaluating the mesh keeps the
+  // CPU over budget. Render thread only.
+  void renderLoopCheckCPULoad();
+  // Rebuilds projectM with tier q's settings. Render thread only.
+  void renderLoopSetQuality(Quality q);
+  // Rebuilds projectM if extraProjectMFrameSize() asks for another
+  // size. Render thread only.
+  void renderLoopUpdateFrameSize();
+  // Rebuilds projectM from settings, keeping its preset and autoplay
+  // state. Render thread only.
+  void renderLoopRebuild();
+  // Creates projectM from settings and sets it up. Render thread only.
+  void renderLoopCreateProjectM();
+  // Publishes a new State if anything changed since the last one, or
+  // if force is set. Render thread only.
+  void renderLoopPublish(bool force = false);
+  // Decides whether the output is hidden, and if so whether this tick
+  // renders a frame. Ticks that don't still drain audio and apply
+  // commands. Returns true if the frame is skipped. Render thread
+  // only.
+  bool renderLoopIdle();
+  // Drains pcmBuffer into projectM. Render thread only.
+  void renderLoopFeedPCM();
+  // Applies capture requests and hands the finished frame to the
+  // current capture, if any. Render thread only.
+  void renderLoopCapture();
+  // The render loop, driven by a RenderWorker with this renderer's
+  // context current. renderLoopStart() creates projectM and returns
+  // false if rendering is impossible. renderLoopStep() renders one
+  // frame. renderLoopSchedule() applies the requested pacing and
+  // returns when the next frame is due. renderLoopStop() destroys
+  // projectM.
+  bool renderLoopStart();
+  void renderLoopStep();
+  FramePacer::Clock::time_point renderLoopSchedule(FramePacer::Clock::time_point now);
+  void renderLoopStop();
+  virtual GLFWwindow* createWindow() { return nullptr; }
 };
 
 class WindowedRenderer : public ProjectMRenderer {
 public:
-  virtual ~WindowedRenderer() {}
+  virtual ~WindowedRenderer() { shutdown(); }
+  bool supportsVSync() const override { return true; }
 
 private:
   GLFWwindow* createWindow() override;
@@ -106,14 +459,70 @@ private:
 
 class TextureRenderer : public ProjectMRenderer {
 public:
-  virtual ~TextureRenderer() {}
-  int getTextureID() const;
-  
+  static const int kFrameSlots = 3;
+
+  virtual ~TextureRenderer() { shutdown(); }
+
+  // Latches the most recently completed frame and returns the slot
+  // holding it, or -1 if no frame has been completed yet. The slot
+  // stays untouched by the render thread until the next call. UI
+  // thread only, with a context of rack::gWindow's share group
+  // current: it waits there for the GPU to finish copying the frame.
+  int acquireLatestFrame();
+
+  // True if a frame was completed since the last
+  // acquireLatestFrame(). UI thread only.
+  bool hasNewFrame() const { return frames.fresh(); }
+
+  // Texture backing the given slot, shared with rack::gWindow's
+  // context.
+  GLuint getFrameTexture(int slot) const;
+  // Size of the frame in the given slot. UI thread only, for the slot
+  // acquireLatestFrame() returned.
+  void getFrameSize(int slot, int* width, int* height) const;
+
+  bool supportsSinks() const override { return true; }
+  // Shows frames in sink too, from the next one on, until the sink is
+  // closed. UI thread only.
+  void addSink(std::shared_ptr<FrameSink> sink);
+
 private:
-  int texture;
+  GLuint texture = 0; // projectM's render target
+  int textureWidth = 0, textureHeight = 0;
+  // Completed frames are copied out of projectM's texture into these,
+  // so the UI never samples a texture the render thread is writing.
+  GLuint frameTextures[kFrameSlots] = {0};
+  // Size of each slot's storage and of the frame in it. The render
+  // thread only changes them for the write slot.
+  int frameWidths[kFrameSlots] = {0}, frameHeights[kFrameSlots] = {0};
+  // Signaled once the copy into each slot is done. Written by the
+  // render thread before publishing the slot, waited on by the UI.
+  GLsync frameFences[kFrameSlots] = {0};
+  GLuint readFramebuffer = 0, drawFramebuffer = 0;
+  TripleBuffer frames;
+  bool hasFrame = false; // UI thread only
+  // Output windows, not yet picked up by the render thread
+  std::mutex sinks_m;
+  std::vector<std::shared_ptr<FrameSink> > addedSinks;
+  std::vector<std::shared_ptr<FrameSink> > sinks; // Render thread only
+  // Frame size for the module's panel, and the size frames should be
+  // drawn at for the sinks since wantedSince. Render thread only.
+  int panelWidth = 0, panelHeight = 0;
+  int wantedWidth = 0, wantedHeight = 0;
+  FramePacer::Clock::time_point wantedSince;
+
+  // Picks up added sinks and drops closed ones. Render thread only.
+  void updateSinks();
 
   GLFWwindow* createWindow() override;
   void extraProjectMInitialization() override;
+  void extraProjectMFrameSize(int* width, int* height) override;
+  void extraProjectMFrameRendered() override;
+  void extraProjectMCleanup() override;
+  void getFrameSource(GLuint* fbo, int* x, int* y) override;
+  // The frame is copied out to frameTextures, there's nothing to show
+  void swapBuffers() override {}
+  bool canShareContext() const override { return true; }
 };
 
 #endif
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef RESOLUTION_SCALER_HPP
+#define RESOLUTION_SCALER_HPP
+
+#include <algorithm>
+#include <cmath>
+
+// ResolutionScaler picks the fraction of the output size projectM
+// renders at, from the GPU time of recent frames. When frames run
+// over the budget the scale drops at once to what should fit; when
+// there's plenty of headroom for a while it creeps back up. GPU time
+// grows with the number of pixels, i.e. with the square of the scale.
+// CPU time (the per-vertex equations) doesn't, so it isn't considered.
+class ResolutionScaler {
+public:
+  static constexpr float kMinScale = 0.5f;
+
+  // Goes back to full resolution.
+  void reset() {
+    current = 1;
+    average = 0;
+    sinceChange = 0;
+  }
+
+  float scale() const { return current; }
+
+  // Accounts for a frame that took gpuMs on the GPU, out of budgetMs.
+  // Returns true if the scale changed.
+  bool frameDone(double gpuMs, double budgetMs) {
+    average = sinceChange ? average + kSmoothing * (gpuMs - average) : gpuMs;
+    if (++sinceChange < kSettleFrames || budgetMs <= 0 || average <= 0) return false;
+
+    double load = average / budgetMs;
+    double next = current;
+    if (load > kHighLoad) {
+      next = current * std::sqrt(kTargetLoad / load);
+    } else if (load < kLowLoad && current < 1 && sinceChange >= kGrowFrames) {
+      next = current * std::min(std::sqrt(kTargetLoad / load), (double)kMaxGrowth);
+    }
+    // Resizing isn't free, small steps aren't worth it
+    next = std::round(next * kSteps) / kSteps;
+    next = std::max((double)kMinScale, std::min(1., next));
+    if ((float)next == current) return false;
+    current = next;
+    sinceChange = 0;
+    return true;
+  }
+
+private:
+  // Share of the frame budget the GPU should be busy for
+  static constexpr double kTargetLoad = 0.75;
+  static constexpr double kHighLoad = 0.9;
+  static constexpr double kLowLoad = 0.5;
+  // Timings arrive a few frames late, and the first frames at a new
+  // size are not representative.
+  static const int kSettleFrames = 15;
+  // Frames of headroom before scaling back up, and by how much at most
+  static const int kGrowFrames = 120;
+  static constexpr double kMaxGrowth = 1.15;
+  static const int kSteps = 32;
+  static constexpr double kSmoothing = 0.1;
+
+  float current = 1;
+  double average = 0; // Smoothed GPU time, ms
+  int sinceChange = 0; // Frames measured at the current scale
+};
+
+#endif
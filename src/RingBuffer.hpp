@@ -0,0 +1,85 @@
+#pragma once
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+
+// Fixed-capacity single-producer/single-consumer ring buffer. Exactly
+// one thread may push and exactly one other thread may pop. Neither
+// side ever blocks, takes a lock or allocates, so it is safe to use
+// from the engine thread.
+template<typename T, size_t N>
+class SPSCRingBuffer {
+  static_assert(N && (N & (N - 1)) == 0, "SPSCRingBuffer capacity must be a power of two");
+
+public:
+  SPSCRingBuffer() : head(0), tail(0) {}
+
+  static constexpr size_t capacity() { return N; }
+
+  // Appends v. Returns false, leaving the buffer untouched, if it is
+  // full. Producer only.
+  bool push(T const& v) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= N) {
+      return false;
+    }
+    data[h & (N - 1)] = v;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Appends as many of the n elements at v as fit, in order, and
+  // returns how many were appended. Producer only.
+  size_t push(T const* v, size_t n) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t space = N - (h - tail.load(std::memory_order_acquire));
+    if (n > space) n = space;
+    for (size_t i = 0; i < n; ++i) {
+      data[(h + i) & (N - 1)] = v[i];
+    }
+    head.store(h + n, std::memory_order_release);
+    return n;
+  }
+
+  // Copies up to max elements into out, oldest first, and returns how
+  // many were copied. Consumer only.
+  size_t pop(T* out, size_t max) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t n = head.load(std::memory_order_acquire) - t;
+    if (n > max) n = max;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = data[(t + i) & (N - 1)];
+    }
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  // Drops up to n of the oldest elements and returns how many were
+  // dropped. Consumer only.
+  size_t skip(size_t n) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t avail = head.load(std::memory_order_acquire) - t;
+    if (n > avail) n = avail;
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  // Number of elements currently queued. Exact when called from
+  // either end, approximate from any other thread.
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+private:
+  // head and tail are free-running counters; they are kept on
+  // separate cache lines so the two threads don't false-share.
+  std::atomic<size_t> head;
+  char pad0[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;
+  char pad1[64 - sizeof(std::atomic<size_t>)];
+  T data[N];
+};
+
+#endif
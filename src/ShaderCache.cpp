@@ -0,0 +1,461 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "ShaderCache.hpp"
+#include "GLFW/glfw3.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <utime.h>
+
+static const char kFileMagic[4] = {'M', 'K', 'S', 'C'};
+
+ShaderCache& ShaderCache::get() {
+  static ShaderCache cache;
+  return cache;
+}
+
+void ShaderCache::setDirectory(std::string const& dir) {
+  size_t budget;
+  {
+    std::lock_guard<std::mutex> l(m);
+    budget = diskBudget;
+  }
+  size_t bytes = prune(dir, budget);
+  std::lock_guard<std::mutex> l(m);
+  directory = dir;
+  diskBytes = bytes;
+  // Shaders known to compile from previous sessions
+  std::ifstream f(directory + "/known_shaders", std::ios::binary);
+  uint64_t h;
+  while (f.read(reinterpret_cast<char*>(&h), sizeof(h))) {
+    knownGood.insert(h);
+  }
+}
+
+void ShaderCache::setMemoryBudget(size_t bytes) {
+  std::lock_guard<std::mutex> l(m);
+  memoryBudget = bytes;
+  while (memoryBytes > memoryBudget && !lru.empty()) {
+    auto it = binaries.find(lru.back());
+    memoryBytes -= it->second.binary.data.size();
+    binaries.erase(it);
+    lru.pop_back();
+  }
+}
+
+void ShaderCache::setDiskBudget(size_t bytes) {
+  std::lock_guard<std::mutex> l(m);
+  diskBudget = bytes;
+}
+
+uint64_t ShaderCache::hits() const {
+  std::lock_guard<std::mutex> l(m);
+  return hitCount;
+}
+
+uint64_t ShaderCache::misses() const {
+  std::lock_guard<std::mutex> l(m);
+  return missCount;
+}
+
+void ShaderCache::countHit(bool hit) {
+  std::lock_guard<std::mutex> l(m);
+  if (hit) ++hitCount;
+  else ++missCount;
+}
+
+// FNV-1a
+uint64_t ShaderCache::hash(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string ShaderCache::pathFor(uint64_t key) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+  return directory + name;
+}
+
+void ShaderCache::remember(uint64_t key, Binary const& b) {
+  auto it = binaries.find(key);
+  if (it != binaries.end()) {
+    memoryBytes -= it->second.binary.data.size();
+    lru.erase(it->second.used);
+  } else {
+    it = binaries.insert(std::make_pair(key, Cached())).first;
+  }
+  it->second.binary = b;
+  lru.push_front(key);
+  it->second.used = lru.begin();
+  memoryBytes += b.data.size();
+  // Never drops the one just added
+  while (memoryBytes > memoryBudget && lru.size() > 1) {
+    auto old = binaries.find(lru.back());
+    memoryBytes -= old->second.binary.data.size();
+    binaries.erase(old);
+    lru.pop_back();
+  }
+}
+
+size_t ShaderCache::prune(std::string const& dir, size_t budget) {
+  struct File {
+    std::string path;
+    time_t used;
+    size_t bytes;
+  };
+  std::vector<File> files;
+  size_t total = 0;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return 0;
+  while (struct dirent* e = readdir(d)) {
+    std::string name = e->d_name;
+    if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bin")) continue;
+    File f;
+    f.path = dir + "/" + name;
+    struct stat st;
+    if (stat(f.path.c_str(), &st)) continue;
+    f.used = st.st_mtime;
+    f.bytes = st.st_size;
+    files.push_back(f);
+    total += f.bytes;
+  }
+  closedir(d);
+
+  // Least recently used last
+  std::sort(files.begin(), files.end(), [](File const& a, File const& b) { return a.used > b.used; });
+  time_t oldest = time(nullptr) - kMaxAgeDays * 24 * 3600;
+  // Down to 3/4 of the budget, so that pruning isn't needed again
+  // after every store
+  while (!files.empty() && (total > budget / 4 * 3 || files.back().used < oldest)) {
+    std::remove(files.back().path.c_str());
+    total -= files.back().bytes;
+    files.pop_back();
+  }
+  return total;
+}
+
+bool ShaderCache::find(uint64_t key, Binary& out) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> l(m);
+    auto it = binaries.find(key);
+    if (it != binaries.end()) {
+      lru.erase(it->second.used);
+      lru.push_front(key);
+      it->second.used = lru.begin();
+      out = it->second.binary;
+      return true;
+    }
+    if (directory.empty()) return false;
+    path = pathFor(key);
+  }
+
+  std::ifstream f(path, std::ios::binary);
+  char magic[4];
+  Binary b;
+  if (!f.read(magic, sizeof(magic)) || memcmp(magic, kFileMagic, sizeof(magic))) return false;
+  if (!f.read(reinterpret_cast<char*>(&b.format), sizeof(b.format))) return false;
+  b.data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  if (b.data.empty()) return false;
+  // Files are aged by when they were last used
+  f.close();
+  utime(path.c_str(), nullptr);
+
+  std::lock_guard<std::mutex> l(m);
+  remember(key, b);
+  out = b;
+  return true;
+}
+
+void ShaderCache::store(uint64_t key, Binary const& b, std::vector<uint64_t> const& shaders) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> l(m);
+    remember(key, b);
+    std::vector<uint64_t> added;
+    for (uint64_t h : shaders) {
+      if (knownGood.insert(h).second) added.push_back(h);
+    }
+    if (directory.empty()) return;
+    path = pathFor(key);
+    if (!added.empty()) {
+      std::ofstream f(directory + "/known_shaders", std::ios::binary | std::ios::app);
+      f.write(reinterpret_cast<const char*>(added.data()), added.size() * sizeof(uint64_t));
+    }
+  }
+
+  // Write to a temporary file then move it in place, so that another
+  // instance never reads a partial binary.
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    f.write(kFileMagic, sizeof(kFileMagic));
+    f.write(reinterpret_cast<const char*>(&b.format), sizeof(b.format));
+    f.write(b.data.data(), b.data.size());
+    if (!f) {
+      f.close();
+      std::remove(tmp.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str())) return;
+
+  std::string dir;
+  size_t budget;
+  {
+    std::lock_guard<std::mutex> l(m);
+    diskBytes += sizeof(kFileMagic) + sizeof(b.format) + b.data.size();
+    if (diskBytes <= diskBudget || pruning) return;
+    pruning = true;
+    dir = directory;
+    budget = diskBudget;
+  }
+  size_t bytes = prune(dir, budget);
+  std::lock_guard<std::mutex> l(m);
+  diskBytes = bytes;
+  pruning = false;
+}
+
+bool ShaderCache::isKnownGood(uint64_t shader) const {
+  std::lock_guard<std::mutex> l(m);
+  return knownGood.count(shader) > 0;
+}
+
+
+#ifdef MILKRACK_SHADER_CACHE
+
+// What follows replaces projectM's calls to the GL shader functions
+// (the plugin is linked with -Wl,--wrap=<function>). Our own GL calls
+// go through GLEW and are not affected.
+//
+// Compilation of a shader we have seen in a cached program is
+// deferred: projectM is told it compiled, and at link time we either
+// load the cached binary and never compile it at all, or compile it
+// then and link as usual.
+
+extern "C" {
+void __real_glShaderSource(GLuint shader, GLsizei count, const GLchar* const* string, const GLint* length);
+void __real_glCompileShader(GLuint shader);
+void __real_glGetShaderiv(GLuint shader, GLenum pname, GLint* params);
+void __real_glGetShaderInfoLog(GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+void __real_glAttachShader(GLuint program, GLuint shader);
+void __real_glDetachShader(GLuint program, GLuint shader);
+void __real_glLinkProgram(GLuint program);
+void __real_glDeleteShader(GLuint shader);
+void __real_glDeleteProgram(GLuint program);
+}
+
+namespace {
+
+// Object names are only unique within a context
+typedef std::pair<GLFWwindow*, GLuint> ObjectKey;
+
+struct ShaderRecord {
+  uint64_t hash = 0;
+  bool pending = false; // Compilation was deferred
+};
+
+struct ContextRecord {
+  bool binaries = false; // Context supports program binaries
+  uint64_t driver = 0; // Hash identifying the driver
+};
+
+std::mutex records_m;
+std::map<ObjectKey, ShaderRecord> shaders;
+std::map<ObjectKey, std::vector<GLuint> > programs;
+std::map<GLFWwindow*, ContextRecord> contexts;
+
+ObjectKey keyFor(GLuint name) {
+  return ObjectKey(glfwGetCurrentContext(), name);
+}
+
+ContextRecord currentContext() {
+  GLFWwindow* w = glfwGetCurrentContext();
+  {
+    std::lock_guard<std::mutex> l(records_m);
+    auto it = contexts.find(w);
+    if (it != contexts.end()) return it->second;
+  }
+  ContextRecord c;
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  c.binaries = formats > 0;
+  // Binaries are only valid for the driver that produced them
+  c.driver = ShaderCache::kHashSeed;
+  const GLenum strings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  for (GLenum s : strings) {
+    const char* v = reinterpret_cast<const char*>(glGetString(s));
+    if (v) c.driver = ShaderCache::hash(c.driver, v, strlen(v));
+  }
+  std::lock_guard<std::mutex> l(records_m);
+  contexts[w] = c;
+  return c;
+}
+
+// Compiles a shader whose compilation was deferred, if any.
+void compilePending(GLuint shader) {
+  {
+    std::lock_guard<std::mutex> l(records_m);
+    auto it = shaders.find(keyFor(shader));
+    if (it == shaders.end() || !it->second.pending) return;
+    it->second.pending = false;
+  }
+  __real_glCompileShader(shader);
+}
+
+bool isPending(GLuint shader) {
+  std::lock_guard<std::mutex> l(records_m);
+  auto it = shaders.find(keyFor(shader));
+  return it != shaders.end() && it->second.pending;
+}
+
+} // namespace
+
+extern "C" {
+
+void __wrap_glShaderSource(GLuint shader, GLsizei count, const GLchar* const* string, const GLint* length) {
+  __real_glShaderSource(shader, count, string, length);
+  GLint type = 0;
+  __real_glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+  uint64_t h = ShaderCache::hash(ShaderCache::kHashSeed, &type, sizeof(type));
+  for (GLsizei i = 0; i < count; ++i) {
+    size_t len = (length && length[i] >= 0) ? length[i] : strlen(string[i]);
+    h = ShaderCache::hash(h, string[i], len);
+  }
+  std::lock_guard<std::mutex> l(records_m);
+  ShaderRecord& r = shaders[keyFor(shader)];
+  r.hash = h;
+  r.pending = false;
+}
+
+void __wrap_glCompileShader(GLuint shader) {
+  uint64_t h;
+  {
+    std::lock_guard<std::mutex> l(records_m);
+    auto it = shaders.find(keyFor(shader));
+    h = it != shaders.end() ? it->second.hash : 0;
+  }
+  if (h && ShaderCache::get().isKnownGood(h) && currentContext().binaries) {
+    std::lock_guard<std::mutex> l(records_m);
+    shaders[keyFor(shader)].pending = true;
+    return;
+  }
+  __real_glCompileShader(shader);
+}
+
+void __wrap_glGetShaderiv(GLuint shader, GLenum pname, GLint* params) {
+  if (isPending(shader)) {
+    // Only ever deferred for shaders that are known to compile
+    if (pname == GL_COMPILE_STATUS) {
+      *params = GL_TRUE;
+      return;
+    }
+    if (pname == GL_INFO_LOG_LENGTH) {
+      *params = 0;
+      return;
+    }
+    compilePending(shader);
+  }
+  __real_glGetShaderiv(shader, pname, params);
+}
+
+void __wrap_glGetShaderInfoLog(GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog) {
+  compilePending(shader);
+  __real_glGetShaderInfoLog(shader, bufSize, length, infoLog);
+}
+
+void __wrap_glAttachShader(GLuint program, GLuint shader) {
+  __real_glAttachShader(program, shader);
+  std::lock_guard<std::mutex> l(records_m);
+  programs[keyFor(program)].push_back(shader);
+}
+
+void __wrap_glDetachShader(GLuint program, GLuint shader) {
+  __real_glDetachShader(program, shader);
+  std::lock_guard<std::mutex> l(records_m);
+  std::vector<GLuint>& attached = programs[keyFor(program)];
+  for (auto it = attached.begin(); it != attached.end(); ++it) {
+    if (*it == shader) {
+      attached.erase(it);
+      break;
+    }
+  }
+}
+
+void __wrap_glLinkProgram(GLuint program) {
+  ContextRecord c = currentContext();
+  if (!c.binaries) {
+    __real_glLinkProgram(program);
+    return;
+  }
+
+  std::vector<GLuint> attached;
+  std::vector<uint64_t> shaderHashes;
+  uint64_t key = c.driver;
+  {
+    std::lock_guard<std::mutex> l(records_m);
+    attached = programs[keyFor(program)];
+    for (GLuint s : attached) {
+      uint64_t h = shaders[keyFor(s)].hash;
+      shaderHashes.push_back(h);
+      key = ShaderCache::hash(key, &h, sizeof(h));
+    }
+  }
+
+  ShaderCache& cache = ShaderCache::get();
+  ShaderCache::Binary b;
+  if (cache.find(key, b)) {
+    glProgramBinary(program, b.format, b.data.data(), b.data.size());
+    GLint ok = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (ok) {
+      cache.countHit(true);
+      return;
+    }
+    // Stale binary, e.g. after a driver update; rebuild it below
+  }
+  cache.countHit(false);
+
+  for (GLuint s : attached) {
+    compilePending(s);
+  }
+  glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  __real_glLinkProgram(program);
+
+  GLint ok = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  GLint len = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+  if (!ok || len <= 0) return;
+  b.data.resize(len);
+  GLenum format = 0;
+  glGetProgramBinary(program, len, nullptr, &format, b.data.data());
+  b.format = format;
+  cache.store(key, b, shaderHashes);
+}
+
+void __wrap_glDeleteShader(GLuint shader) {
+  __real_glDeleteShader(shader);
+  std::lock_guard<std::mutex> l(records_m);
+  shaders.erase(keyFor(shader));
+}
+
+void __wrap_glDeleteProgram(GLuint program) {
+  __real_glDeleteProgram(program);
+  std::lock_guard<std::mutex> l(records_m);
+  programs.erase(keyFor(program));
+}
+
+} // extern "C"
+
+#endif
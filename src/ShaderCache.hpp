@@ -0,0 +1,94 @@
+#pragma once
+#ifndef SHADER_CACHE_HPP
+#define SHADER_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// ShaderCache remembers the linked binary of every shader program
+// projectM builds, keyed by a hash of the program's shader sources and
+// of the GL driver, and persists them to disk. When a preset comes
+// back, in this process or after a restart, its programs are loaded
+// with glProgramBinary instead of being compiled and linked again.
+// Both the memory and the disk copies are bounded, least recently used
+// programs are dropped first.
+//
+// projectM is not aware of the cache: when the plugin is linked with
+// MILKRACK_SHADER_CACHE, projectM's calls to the GL shader functions
+// are redirected (ld --wrap) through ShaderCache.cpp.
+class ShaderCache {
+public:
+  static ShaderCache& get();
+
+  // Directory program binaries are persisted under. Must exist. Until
+  // this is set, binaries are only cached in memory.
+  void setDirectory(std::string const& dir);
+  // Bytes of binaries kept in memory. Binaries dropped from memory are
+  // read back from disk when needed again.
+  void setMemoryBudget(size_t bytes);
+  // Bytes of binaries kept on disk. Files over it, or unused for
+  // kMaxAgeDays, are deleted when the directory is set and whenever
+  // stored binaries go over it.
+  void setDiskBudget(size_t bytes);
+
+  // Cache statistics, for diagnostics
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+  struct Binary {
+    uint32_t format;
+    std::vector<char> data;
+  };
+
+  // Looks up a program binary in memory, then on disk.
+  bool find(uint64_t key, Binary& out);
+  // Stores a program binary in memory and on disk, and remembers its
+  // shaders as known to compile.
+  void store(uint64_t key, Binary const& b, std::vector<uint64_t> const& shaders);
+  // True if a shader with this source hash was part of a program that
+  // linked successfully, which means its compilation can be deferred
+  // until we know whether the program is cached.
+  bool isKnownGood(uint64_t shader) const;
+  void countHit(bool hit);
+
+  static uint64_t hash(uint64_t h, const void* data, size_t len);
+  static const uint64_t kHashSeed = 14695981039346656037ULL;
+
+private:
+  ShaderCache() {}
+  std::string pathFor(uint64_t key) const;
+  // Adds or refreshes a binary in memory, and drops the least recently
+  // used ones over the budget. Called with m held.
+  void remember(uint64_t key, Binary const& b);
+  // Deletes the least recently used files in dir until they fit in
+  // budget. Returns the bytes left.
+  static size_t prune(std::string const& dir, size_t budget);
+
+  static const int kMaxAgeDays = 90;
+
+  struct Cached {
+    Binary binary;
+    std::list<uint64_t>::iterator used; // Position in lru
+  };
+
+  mutable std::mutex m;
+  std::string directory;
+  std::map<uint64_t, Cached> binaries;
+  std::list<uint64_t> lru; // Keys in binaries, most recently used first
+  size_t memoryBytes = 0;
+  size_t memoryBudget = 0;
+  size_t diskBytes = 0; // Estimated, exact after a prune
+  size_t diskBudget = 0;
+  bool pruning = false;
+  std::set<uint64_t> knownGood;
+  uint64_t hitCount = 0;
+  uint64_t missCount = 0;
+};
+
+#endif
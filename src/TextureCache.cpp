@@ -0,0 +1,381 @@
+#define NANOVG_GL2
+#include "window.hpp"
+
+#include "TextureCache.hpp"
+#include "ShaderCache.hpp"
+#include "GLFW/glfw3.h"
+
+// The bindings of the context the thread renders in, if it shares
+// textures
+static thread_local TextureCache::ContextState* current = nullptr;
+
+// Deletes a shared texture, see below
+static void deleteShared(TextureCache::Entry* e);
+
+TextureCache& TextureCache::get() {
+  static TextureCache cache;
+  return cache;
+}
+
+void TextureCache::setBudget(size_t bytes) {
+  std::lock_guard<std::mutex> l(m);
+  budget = bytes;
+}
+
+size_t TextureCache::bytes() const {
+  std::lock_guard<std::mutex> l(m);
+  return totalBytes;
+}
+
+uint64_t TextureCache::hits() const {
+  std::lock_guard<std::mutex> l(m);
+  return hitCount;
+}
+
+uint64_t TextureCache::misses() const {
+  std::lock_guard<std::mutex> l(m);
+  return missCount;
+}
+
+void TextureCache::setCurrentContext(const void* context) {
+  if (!context) {
+    current = nullptr;
+    return;
+  }
+  TextureCache& cache = get();
+  std::lock_guard<std::mutex> l(cache.m);
+  current = &cache.contexts[context];
+}
+
+TextureCache::ContextState* TextureCache::currentContext() {
+  return current;
+}
+
+void TextureCache::forgetContext(const void* context) {
+  std::lock_guard<std::mutex> l(m);
+  contexts.erase(context);
+}
+
+TextureCache::Entry* TextureCache::acquire(uint64_t key) {
+  std::lock_guard<std::mutex> l(m);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    ++missCount;
+    return nullptr;
+  }
+  Entry* e = it->second;
+  if (e->refs++ == 0) {
+    lru.erase(e->unused);
+    unusedBytes -= e->bytes;
+  }
+  ++hitCount;
+  return e;
+}
+
+TextureCache::Entry* TextureCache::insert(Entry* e) {
+  std::lock_guard<std::mutex> l(m);
+  auto it = entries.find(e->key);
+  if (it != entries.end()) {
+    Entry* existing = it->second;
+    if (existing->refs++ == 0) {
+      lru.erase(existing->unused);
+      unusedBytes -= existing->bytes;
+    }
+    return existing;
+  }
+  e->refs = 1;
+  entries[e->key] = e;
+  totalBytes += e->bytes;
+  return e;
+}
+
+void TextureCache::map(unsigned name, Entry* e) {
+  std::lock_guard<std::mutex> l(m);
+  names[name] = e;
+}
+
+TextureCache::Entry* TextureCache::find(unsigned name) const {
+  std::lock_guard<std::mutex> l(m);
+  auto it = names.find(name);
+  return it == names.end() ? nullptr : it->second;
+}
+
+void TextureCache::unmap(unsigned name) {
+  std::lock_guard<std::mutex> l(m);
+  auto it = names.find(name);
+  if (it == names.end()) return;
+  Entry* e = it->second;
+  names.erase(it);
+  if (--e->refs == 0) {
+    lru.push_front(e);
+    e->unused = lru.begin();
+    unusedBytes += e->bytes;
+  }
+  if (current) evict();
+}
+
+void TextureCache::evict() {
+  while (unusedBytes > budget && !lru.empty()) {
+    Entry* e = lru.back();
+    lru.pop_back();
+    entries.erase(e->key);
+    totalBytes -= e->bytes;
+    unusedBytes -= e->bytes;
+    deleteShared(e);
+    delete e;
+  }
+}
+
+
+#ifdef MILKRACK_TEXTURE_CACHE
+
+// What follows replaces projectM's calls to the GL texture functions
+// (the plugin is linked with -Wl,--wrap=<function>). Unlike the
+// shader functions, most of these are GL 1.1 and our own calls to
+// them aren't routed through GLEW, so they're wrapped too. They pass
+// straight through on threads that don't share textures, and for
+// anything but RGB(A) images uploaded whole.
+//
+// When projectM uploads an image, the pixels go to a texture owned by
+// the cache, unless one already holds them, and that texture is bound
+// wherever projectM binds its own. If projectM later writes to its
+// texture, or attaches it to a framebuffer, it first gets a copy of
+// its own.
+
+extern "C" {
+void __real_glActiveTexture(GLenum texture);
+void __real_glBindTexture(GLenum target, GLuint texture);
+void __real_glDeleteTextures(GLsizei n, const GLuint* textures);
+void __real_glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void* pixels);
+void __real_glTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels);
+void __real_glCopyTexImage2D(GLenum target, GLint level, GLenum internalformat, GLint x, GLint y, GLsizei width, GLsizei height, GLint border);
+void __real_glCopyTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint x, GLint y, GLsizei width, GLsizei height);
+void __real_glFramebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+}
+
+static void deleteShared(TextureCache::Entry* e) {
+  __real_glDeleteTextures(1, &e->texture);
+  glDeleteSync(static_cast<GLsync>(e->fence));
+}
+
+namespace {
+
+typedef TextureCache::ContextState ContextState;
+typedef TextureCache::Entry Entry;
+
+// The texture projectM has bound to the active unit
+GLuint boundName(ContextState* c) {
+  return c->unit < (unsigned)ContextState::kUnits ? c->bound[c->unit] : 0;
+}
+
+// The texture GL should use for projectM's name
+GLuint realName(GLuint name) {
+  Entry* e = name ? TextureCache::get().find(name) : nullptr;
+  return e ? e->texture : name;
+}
+
+// Only textures that can be copied to a framebuffer are shared, so
+// that projectM can always be given its own copy.
+size_t bytesPerPixel(GLint internalFormat, GLenum format, GLenum type) {
+  if (type != GL_UNSIGNED_BYTE) return 0;
+  if (format == GL_RGBA && (internalFormat == GL_RGBA || internalFormat == GL_RGBA8)) return 4;
+  if (format == GL_RGB && (internalFormat == GL_RGB || internalFormat == GL_RGB8)) return 3;
+  return 0;
+}
+
+// True if pixels are read as a plain array, in which case alignment
+// is set to the row alignment.
+bool plainUnpack(GLint* alignment) {
+  const GLenum state[] = {GL_PIXEL_UNPACK_BUFFER_BINDING, GL_UNPACK_ROW_LENGTH, GL_UNPACK_SKIP_ROWS, GL_UNPACK_SKIP_PIXELS};
+  for (GLenum s : state) {
+    GLint v = 0;
+    glGetIntegerv(s, &v);
+    if (v) return false;
+  }
+  glGetIntegerv(GL_UNPACK_ALIGNMENT, alignment);
+  return *alignment > 0;
+}
+
+// The upload may have been made in another context
+void waitFor(Entry* e) {
+  glWaitSync(static_cast<GLsync>(e->fence), 0, GL_TIMEOUT_IGNORED);
+}
+
+// Gives name storage of its own, with the contents of the shared
+// texture it's bound to.
+void unshare(ContextState* c, GLuint name) {
+  TextureCache& cache = TextureCache::get();
+  Entry* e = cache.find(name);
+  if (!e) return;
+  waitFor(e);
+
+  // Sampling parameters belong to the texture
+  const GLenum params[] = {GL_TEXTURE_MIN_FILTER, GL_TEXTURE_MAG_FILTER, GL_TEXTURE_WRAP_S, GL_TEXTURE_WRAP_T};
+  GLint values[4];
+  __real_glBindTexture(GL_TEXTURE_2D, e->texture);
+  for (int i = 0; i < 4; ++i) {
+    glGetTexParameteriv(GL_TEXTURE_2D, params[i], &values[i]);
+  }
+  __real_glBindTexture(GL_TEXTURE_2D, name);
+  __real_glTexImage2D(GL_TEXTURE_2D, 0, e->internalFormat, e->width, e->height, 0, e->format, e->type, nullptr);
+  for (int i = 0; i < 4; ++i) {
+    glTexParameteri(GL_TEXTURE_2D, params[i], values[i]);
+  }
+
+  GLint readFramebuffer = 0, drawFramebuffer = 0;
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFramebuffer);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFramebuffer);
+  GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+  if (scissor) glDisable(GL_SCISSOR_TEST);
+  GLuint framebuffers[2];
+  glGenFramebuffers(2, framebuffers);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[0]);
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, e->texture, 0);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1]);
+  glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, name, 0);
+  glBlitFramebuffer(0, 0, e->width, e->height, 0, 0, e->width, e->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glDeleteFramebuffers(2, framebuffers);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+  if (scissor) glEnable(GL_SCISSOR_TEST);
+
+  cache.unmap(name);
+  __real_glBindTexture(GL_TEXTURE_2D, realName(boundName(c)));
+}
+
+// projectM is about to replace the bound texture's level
+void respecify(ContextState* c, GLint level) {
+  GLuint name = boundName(c);
+  if (!name || !TextureCache::get().find(name)) return;
+  if (level == 0) {
+    // Nothing to copy
+    TextureCache::get().unmap(name);
+    __real_glBindTexture(GL_TEXTURE_2D, name);
+  } else {
+    unshare(c, name);
+  }
+}
+
+} // namespace
+
+extern "C" {
+
+void __wrap_glActiveTexture(GLenum texture) {
+  __real_glActiveTexture(texture);
+  ContextState* c = TextureCache::currentContext();
+  if (c) c->unit = texture - GL_TEXTURE0;
+}
+
+void __wrap_glBindTexture(GLenum target, GLuint texture) {
+  ContextState* c = TextureCache::currentContext();
+  if (!c || target != GL_TEXTURE_2D) {
+    __real_glBindTexture(target, texture);
+    return;
+  }
+  if (c->unit < (unsigned)ContextState::kUnits) {
+    c->bound[c->unit] = texture;
+  } else {
+    // Writes through this unit couldn't be told apart
+    unshare(c, texture);
+  }
+  __real_glBindTexture(target, realName(texture));
+}
+
+void __wrap_glDeleteTextures(GLsizei n, const GLuint* textures) {
+  ContextState* c = TextureCache::currentContext();
+  if (c) {
+    TextureCache& cache = TextureCache::get();
+    for (GLsizei i = 0; i < n; ++i) {
+      for (int u = 0; u < ContextState::kUnits; ++u) {
+	if (c->bound[u] == textures[i]) c->bound[u] = 0;
+      }
+      cache.unmap(textures[i]);
+    }
+  }
+  __real_glDeleteTextures(n, textures);
+}
+
+void __wrap_glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void* pixels) {
+  ContextState* c = TextureCache::currentContext();
+  if (!c || target != GL_TEXTURE_2D) {
+    __real_glTexImage2D(target, level, internalformat, width, height, border, format, type, pixels);
+    return;
+  }
+  respecify(c, level);
+  GLuint name = boundName(c);
+  size_t bpp = bytesPerPixel(internalformat, format, type);
+  GLint alignment = 4;
+  if (!name || level != 0 || !pixels || border || !bpp || width <= 0 || height <= 0 || !plainUnpack(&alignment)) {
+    __real_glTexImage2D(target, level, internalformat, width, height, border, format, type, pixels);
+    return;
+  }
+
+  size_t row = width * bpp;
+  size_t stride = (row + alignment - 1) / alignment * alignment;
+  uint64_t key = ShaderCache::kHashSeed;
+  const GLint shape[] = {internalformat, width, height, (GLint)format, alignment};
+  key = ShaderCache::hash(key, shape, sizeof(shape));
+  key = ShaderCache::hash(key, pixels, stride * (height - 1) + row);
+
+  TextureCache& cache = TextureCache::get();
+  Entry* e = cache.acquire(key);
+  if (!e) {
+    e = new Entry();
+    e->key = key;
+    e->internalFormat = internalformat;
+    e->width = width;
+    e->height = height;
+    e->format = format;
+    e->type = type;
+    e->bytes = (size_t)width * height * 4; // Drivers pad RGB to RGBA
+    GLuint texture;
+    glGenTextures(1, &texture);
+    e->texture = texture;
+    __real_glBindTexture(GL_TEXTURE_2D, texture);
+    __real_glTexImage2D(target, level, internalformat, width, height, border, format, type, pixels);
+    e->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // Other contexts wait on the fence, it has to reach the GPU
+    glFlush();
+    Entry* used = cache.insert(e);
+    if (used != e) {
+      deleteShared(e);
+      delete e;
+      e = used;
+    }
+  }
+  waitFor(e);
+  cache.map(name, e);
+  __real_glBindTexture(GL_TEXTURE_2D, e->texture);
+}
+
+void __wrap_glTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels) {
+  ContextState* c = TextureCache::currentContext();
+  if (c && target == GL_TEXTURE_2D) unshare(c, boundName(c));
+  __real_glTexSubImage2D(target, level, xoffset, yoffset, width, height, format, type, pixels);
+}
+
+void __wrap_glCopyTexImage2D(GLenum target, GLint level, GLenum internalformat, GLint x, GLint y, GLsizei width, GLsizei height, GLint border) {
+  ContextState* c = TextureCache::currentContext();
+  if (c && target == GL_TEXTURE_2D) respecify(c, level);
+  __real_glCopyTexImage2D(target, level, internalformat, x, y, width, height, border);
+}
+
+void __wrap_glCopyTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint x, GLint y, GLsizei width, GLsizei height) {
+  ContextState* c = TextureCache::currentContext();
+  if (c && target == GL_TEXTURE_2D) unshare(c, boundName(c));
+  __real_glCopyTexSubImage2D(target, level, xoffset, yoffset, x, y, width, height);
+}
+
+void __wrap_glFramebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level) {
+  ContextState* c = TextureCache::currentContext();
+  if (c && texture) unshare(c, texture);
+  __real_glFramebufferTexture2D(target, attachment, textarget, texture, level);
+}
+
+} // extern "C"
+
+#else
+
+static void deleteShared(TextureCache::Entry* e) {}
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+#ifndef TEXTURE_CACHE_HPP
+#define TEXTURE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// TextureCache lets the instances that render in contexts shared with
+// Rack's window share the textures projectM loads: preset images,
+// sprites, noise. Textures are keyed by a hash of their pixels, so an
+// image is stored once on the GPU however many instances use it.
+// Textures no instance uses anymore are kept for when a preset comes
+// back, and dropped least recently used first once they take more
+// than the budget.
+//
+// projectM is not aware of the cache: when the plugin is linked with
+// MILKRACK_TEXTURE_CACHE, projectM's calls to the GL texture functions
+// are redirected (ld --wrap) through TextureCache.cpp. The texture
+// names projectM creates stay its own; they're bound to the shared
+// texture instead, until projectM writes to one of them.
+class TextureCache {
+public:
+  static TextureCache& get();
+
+  // Bytes of textures no instance uses that are kept around
+  void setBudget(size_t bytes);
+
+  // Cache statistics, for diagnostics
+  size_t bytes() const; // Held by the cache, used or not
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+  // The context the calling thread renders in. Only contexts in
+  // rack::gWindow's share group can share textures, for any other
+  // pass nullptr and projectM's calls go straight to GL.
+  static void setCurrentContext(const void* context);
+  // Called before a context is destroyed
+  void forgetContext(const void* context);
+
+  struct Entry {
+    uint64_t key;
+    unsigned texture; // The shared texture
+    int internalFormat, width, height;
+    unsigned format, type;
+    size_t bytes;
+    void* fence; // Signaled once the upload is done
+    int refs = 0;
+    std::list<Entry*>::iterator unused; // Position in lru when refs is 0
+  };
+
+  // Texture bindings of a context, which the cache needs to know which
+  // texture projectM means to modify.
+  struct ContextState {
+    static const int kUnits = 32;
+    unsigned unit = 0;
+    unsigned bound[kUnits] = {};
+  };
+
+  // The shared texture holding these pixels, with a reference taken,
+  // or null.
+  Entry* acquire(uint64_t key);
+  // Adds a texture uploaded by the caller, with a reference taken.
+  // Returns the entry to use, which is another one if some other
+  // thread added the same pixels first; the caller then deletes its
+  // texture.
+  Entry* insert(Entry* e);
+  // Binds projectM's texture name to a shared texture
+  void map(unsigned name, Entry* e);
+  // The shared texture name is bound to, or null
+  Entry* find(unsigned name) const;
+  // Unbinds name from its shared texture and drops the reference.
+  // Unused textures over the budget are deleted, so the calling
+  // thread must have a context in the share group current.
+  void unmap(unsigned name);
+
+  static ContextState* currentContext();
+
+private:
+  TextureCache() {}
+  // Deletes unused textures until the budget is met. Called with m held.
+  void evict();
+
+  mutable std::mutex m;
+  size_t budget = 0;
+  size_t totalBytes = 0;
+  size_t unusedBytes = 0;
+  uint64_t hitCount = 0;
+  uint64_t missCount = 0;
+  std::unordered_map<uint64_t, Entry*> entries;
+  std::unordered_map<unsigned, Entry*> names;
+  std::list<Entry*> lru; // Unused entries, most recently used first
+  std::map<const void*, ContextState> contexts;
+};
+
+#endif
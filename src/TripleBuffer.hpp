@@ -0,0 +1,52 @@
+#pragma once
+#ifndef TRIPLE_BUFFER_HPP
+#define TRIPLE_BUFFER_HPP
+
+#include <atomic>
+
+// Lock-free triple buffering of three slot indices between one writer
+// and one reader. The writer always has a slot of its own to fill, the
+// reader always has a slot of its own to read, and the third slot holds
+// the most recently published one. Neither side ever waits on the
+// other; the reader simply skips frames it was too slow to see.
+class TripleBuffer {
+public:
+  TripleBuffer() : back(0), middle(1), front(2) {}
+
+  // Slot the writer should fill next. Writer only.
+  int writeSlot() const { return back; }
+
+  // Publishes the writer's slot as the latest complete one and hands
+  // the writer a free slot. Writer only.
+  void publish() {
+    back = middle.exchange(back | kFresh, std::memory_order_acq_rel) & kIndexMask;
+  }
+
+  // Swaps in the latest published slot if one arrived since the last
+  // call. Returns true if readSlot() changed. Reader only.
+  bool acquire() {
+    if (!(middle.load(std::memory_order_relaxed) & kFresh)) {
+      return false;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  // True if acquire() would swap in a new slot. Reader only.
+  bool fresh() const {
+    return middle.load(std::memory_order_relaxed) & kFresh;
+  }
+
+  // Slot the reader currently owns. Reader only.
+  int readSlot() const { return front; }
+
+private:
+  static const int kFresh = 4;
+  static const int kIndexMask = 3;
+
+  int back;
+  std::atomic<int> middle;
+  int front;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "AudioFile.hpp"
+#include <cstring>
+
+static uint32_t le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t le16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+AudioFile::~AudioFile() {
+  if (f) fclose(f);
+}
+
+bool AudioFile::fail(std::string const& e) {
+  error = e;
+  if (f) fclose(f);
+  f = nullptr;
+  return false;
+}
+
+bool AudioFile::openWAV(std::string const& path) {
+  f = fopen(path.c_str(), "rb");
+  if (!f) return fail("cannot open " + path);
+
+  uint8_t header[12];
+  if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+    return fail(path + " is not a WAV file");
+  }
+
+  // Walk the chunks until the data, picking up the format on the way
+  bool haveFormat = false;
+  while (true) {
+    uint8_t chunk[8];
+    if (fread(chunk, sizeof(chunk), 1, f) != 1) {
+      return fail(path + " has no audio data");
+    }
+    uint32_t size = le32(chunk + 4);
+    if (!memcmp(chunk, "fmt ", 4)) {
+      std::vector<uint8_t> fmt(size);
+      if (size < 16 || fread(fmt.data(), size, 1, f) != 1) {
+	return fail(path + " has a broken format chunk");
+      }
+      uint16_t tag = le16(&fmt[0]);
+      if (tag == 0xfffe && size >= 26) {
+	tag = le16(&fmt[24]); // WAVE_FORMAT_EXTENSIBLE, the subformat's tag
+      }
+      channels = le16(&fmt[2]);
+      sampleRate = le32(&fmt[4]);
+      bytesPerSample = le16(&fmt[14]) / 8;
+      if (tag == 1 && bytesPerSample >= 1 && bytesPerSample <= 4) {
+	encoding = INT;
+      } else if (tag == 3 && bytesPerSample == 4) {
+	encoding = FLOAT;
+      } else {
+	return fail(path + " uses an unsupported sample format");
+      }
+      if (channels < 1 || sampleRate <= 0) {
+	return fail(path + " has a broken format chunk");
+      }
+      haveFormat = true;
+      if (size & 1) fseek(f, 1, SEEK_CUR);
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!haveFormat) return fail(path + " has no format chunk");
+      length = size / (channels * bytesPerSample);
+      remaining = length;
+      return true;
+    } else {
+      // Chunks are padded to an even size
+      fseek(f, size + (size & 1), SEEK_CUR);
+    }
+  }
+}
+
+bool AudioFile::openRaw(std::string const& path, int rate) {
+  f = fopen(path.c_str(), "rb");
+  if (!f) return fail("cannot open " + path);
+  encoding = FLOAT;
+  channels = 2;
+  bytesPerSample = 4;
+  sampleRate = rate;
+  if (!fseek(f, 0, SEEK_END)) {
+    long size = ftell(f);
+    if (size > 0) length = size / 8;
+    fseek(f, 0, SEEK_SET);
+  }
+  return true;
+}
+
+float AudioFile::decode(const uint8_t* p) const {
+  if (encoding == FLOAT) {
+    float v;
+    uint32_t bits = le32(p);
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+  switch (bytesPerSample) {
+  case 1: return (p[0] - 128) / 128.f; // 8 bit WAV is unsigned
+  case 2: return (int16_t)le16(p) / 32768.f;
+  case 3: return (int32_t)((p[0] << 8) | (p[1] << 16) | ((uint32_t)p[2] << 24)) / 2147483648.f;
+  default: return (int32_t)le32(p) / 2147483648.f;
+  }
+}
+
+size_t AudioFile::read(StereoFrame* out, size_t max, float gain) {
+  if (!f) return 0;
+  if (max > remaining) max = remaining;
+  size_t frameBytes = channels * bytesPerSample;
+  scratch.resize(max * frameBytes);
+  size_t n = fread(scratch.data(), frameBytes, max, f);
+  remaining -= n;
+  for (size_t i = 0; i < n; ++i) {
+    const uint8_t* p = &scratch[i * frameBytes];
+    out[i].l = gain * decode(p);
+    out[i].r = channels > 1 ? gain * decode(p + bytesPerSample) : out[i].l;
+  }
+  return n;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#ifndef AUDIO_FILE_HPP
+#define AUDIO_FILE_HPP
+
+#include "../PCMBuffer.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// AudioFile streams stereo frames out of a WAV file (8, 16, 24 or 32
+// bit integer, or 32 bit float PCM), or out of a headerless file of
+// interleaved stereo 32 bit floats. Mono files are played on both
+// channels; extra channels are ignored.
+class AudioFile {
+public:
+  AudioFile() {}
+  ~AudioFile();
+
+  // Opens a WAV file. Returns false and sets error if it can't be
+  // read.
+  bool openWAV(std::string const& path);
+
+  // Opens a raw file of interleaved float pairs at the given rate.
+  bool openRaw(std::string const& path, int sampleRate);
+
+  // Reads up to max frames into out, scaled by gain, and returns how
+  // many were read. 0 means the end of the file.
+  size_t read(StereoFrame* out, size_t max, float gain);
+
+  int getSampleRate() const { return sampleRate; }
+  // Total length in frames, if known, 0 otherwise
+  uint64_t getLength() const { return length; }
+  std::string const& getError() const { return error; }
+
+private:
+  enum Encoding { INT, FLOAT };
+
+  FILE* f = nullptr;
+  Encoding encoding = FLOAT;
+  int channels = 2;
+  int bytesPerSample = 4;
+  int sampleRate = 0;
+  uint64_t length = 0;
+  uint64_t remaining = UINT64_MAX; // Frames left to read
+  std::vector<uint8_t> scratch;
+  std::string error;
+
+  bool fail(std::string const& e);
+  float decode(const uint8_t* p) const;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include "window.hpp"
+
+#include "OfflineRenderer.hpp"
+
+bool OfflineRenderer::start(projectM::Settings const& s, std::shared_ptr<PCMBuffer> pcm) {
+  r->settings = s;
+  r->pcmBuffer = pcm;
+  if (!r->createContext()) return false;
+  r->makeContextCurrent();
+  if (!r->renderLoopStart()) {
+    r->releaseContext();
+    r->destroyContext();
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+void OfflineRenderer::step(double time) {
+  r->virtualTime = time;
+  r->renderLoopStep();
+}
+
+void OfflineRenderer::stop() {
+  if (!running) return;
+  if (r->capture) {
+    // Flushed here rather than left to finish in the background, the
+    // process may exit right after
+    r->capture->releaseGL();
+    r->capture.reset();
+  }
+  r->renderLoopStop();
+  r->releaseContext();
+  r->destroyContext();
+  running = false;
+}
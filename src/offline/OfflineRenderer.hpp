@@ -0,0 +1,36 @@
+#pragma once
+#ifndef OFFLINE_RENDERER_HPP
+#define OFFLINE_RENDERER_HPP
+
+#include "../Renderer.hpp"
+
+// OfflineRenderer drives a ProjectMRenderer on the calling thread
+// instead of handing it to the RenderService: there's no pacing, each
+// call to step() renders one frame right away, and captures are timed
+// by a virtual clock rather than the wall clock. The renderer must not
+// be init()ed.
+class OfflineRenderer {
+public:
+  explicit OfflineRenderer(ProjectMRenderer* r) : r(r) {}
+  ~OfflineRenderer() { stop(); }
+
+  // Creates the renderer's context on this thread and starts
+  // projectM. Returns false if rendering is impossible.
+  bool start(projectM::Settings const& s, std::shared_ptr<PCMBuffer> pcm);
+
+  // Renders one frame, which captures see as taking place at time
+  // seconds.
+  void step(double time);
+
+  // Stops projectM and destroys the context. Safe to call more than
+  // once.
+  void stop();
+
+  ProjectMRenderer* renderer() const { return r; }
+
+private:
+  ProjectMRenderer* r;
+  bool running = false;
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "window.hpp"
+
+#include "AudioFile.hpp"
+#include "OfflineRenderer.hpp"
+#include "../HeadlessRenderer.hpp"
+#include "../PresetCosts.hpp"
+#include "util/common.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+// milkrack-bench: measures what every preset costs to load and render
+// against a fixed audio clip, and writes the table PresetCosts reads.
+
+// Time spent compiling and linking shaders on this thread. The Makefile
+// routes projectM's calls through these wrappers with ld --wrap.
+static double compileSeconds = 0;
+
+extern "C" {
+
+void __real_glCompileShader(GLuint shader);
+void __real_glLinkProgram(GLuint program);
+
+void __wrap_glCompileShader(GLuint shader) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  __real_glCompileShader(shader);
+  compileSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void __wrap_glLinkProgram(GLuint program) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  __real_glLinkProgram(program);
+  // Drivers may compile lazily, asking for the result waits for it
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  compileSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+// The reference clip when none is given: two bars at 120 BPM of kick,
+// bass, hats and a chord, the same on every run.
+class ReferenceClip {
+public:
+  explicit ReferenceClip(int rate) : rate(rate) {}
+
+  void read(StereoFrame* out, size_t n) {
+    for (size_t i = 0; i < n; ++i, ++t) {
+      double s = (double)(t % (4 * rate)) / rate; // Position in the 2 bars
+      double beat = fmod(s, 0.5);
+      double kick = sin(2 * M_PI * (50 + 100 * exp(-beat * 30)) * beat) * exp(-beat * 8);
+      double bass = 0.3 * sin(2 * M_PI * (s < 2 ? 55 : 41.2) * s);
+      double offbeat = fmod(s + 0.25, 0.5);
+      noise = noise * 1664525u + 1013904223u;
+      double hat = ((int32_t)noise / 2147483648.0) * 0.15 * exp(-offbeat * 40);
+      double chord = 0.1 * (sin(2 * M_PI * 220 * s) + sin(2 * M_PI * 277.2 * s) + sin(2 * M_PI * 329.6 * s));
+      out[i].l = (float)(kick + bass + hat + chord) * 0.5f;
+      out[i].r = (float)(kick + bass - hat + chord) * 0.5f;
+    }
+  }
+
+private:
+  int rate;
+  uint64_t t = 0;
+  uint32_t noise = 1;
+};
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "Renders every preset for a while and writes what each one costs.\n"
+	  "\n"
+	  "  -p, --presets DIR    preset directory (default: presets_projectM)\n"
+	  "  -o, --output FILE    cost table to write (default: res/preset_costs.json)\n"
+	  "  -n, --frames N       frames to render per preset (default: 300)\n"
+	  "  -W, --width N        frame width (default: 1280)\n"
+	  "  -H, --height N       frame height (default: 720)\n"
+	  "  -a, --audio FILE     WAV file to play (default: a built-in clip)\n"
+	  "  -s, --preset NAME    only presets whose name contains NAME\n",
+	  argv0);
+}
+
+int main(int argc, char** argv) {
+  std::string presetDir = "presets_projectM";
+  std::string output = "res/preset_costs.json";
+  std::string audioPath;
+  std::string filter;
+  int frames = 300;
+  int width = 1280, height = 720;
+  const float fps = 60;
+
+  static const struct option longOptions[] = {
+    {"presets", required_argument, nullptr, 'p'},
+    {"output", required_argument, nullptr, 'o'},
+    {"frames", required_argument, nullptr, 'n'},
+    {"width", required_argument, nullptr, 'W'},
+    {"height", required_argument, nullptr, 'H'},
+    {"audio", required_argument, nullptr, 'a'},
+    {"preset", required_argument, nullptr, 's'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "p:o:n:W:H:a:s:h", longOptions, nullptr)) != -1) {
+    switch (c) {
+    case 'p': presetDir = optarg; break;
+    case 'o': output = optarg; break;
+    case 'n': frames = atoi(optarg); break;
+    case 'W': width = atoi(optarg); break;
+    case 'H': height = atoi(optarg); break;
+    case 'a': audioPath = optarg; break;
+    case 's': filter = optarg; break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 2;
+    }
+  }
+  if (optind != argc || frames <= 0 || width <= 0 || height <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  AudioFile audio;
+  if (!audioPath.empty() && !audio.openWAV(audioPath)) {
+    fprintf(stderr, "%s\n", audio.getError().c_str());
+    return 1;
+  }
+  const int rate = audioPath.empty() ? 44100 : audio.getSampleRate();
+  ReferenceClip clip(rate);
+
+  projectM::Settings s;
+  s.presetURL = presetDir;
+  s.windowWidth = width;
+  s.windowHeight = height;
+  s.fps = fps;
+  s.smoothPresetDuration = 0; // Measure presets alone, not blends
+
+  HeadlessRenderer renderer;
+  std::shared_ptr<PCMBuffer> pcm = std::make_shared<PCMBuffer>();
+  OfflineRenderer offline(&renderer);
+  if (!offline.start(s, pcm)) {
+    fprintf(stderr, "Could not start rendering, see the log above\n");
+    return 1;
+  }
+
+  PresetCosts::Reference ref;
+  ref.width = width;
+  ref.height = height;
+  ref.frames = frames;
+  const char* glRenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  if (glRenderer) ref.renderer = glRenderer;
+
+  // Every preset hears the clip from the start
+  std::vector<StereoFrame> chunk(rate / fps + 2);
+  uint64_t frame = 0;
+  auto step = [&]() {
+    size_t n = (size_t)((frame + 1) * rate / fps) - (size_t)(frame * rate / fps);
+    if (audioPath.empty() || audio.read(chunk.data(), n, 1) < n) {
+      clip.read(chunk.data(), n);
+    }
+    for (size_t i = 0; i < n; ++i) pcm->push(chunk[i].l, chunk[i].r);
+    offline.step(frame / fps);
+    ++frame;
+  };
+
+  std::shared_ptr<const ProjectMRenderer::State> st = renderer.getState();
+  std::map<std::string, PresetCosts::Cost> table;
+  size_t count = st->presetNames ? st->presetNames->size() : 0;
+  for (size_t i = 0; i < count; ++i) {
+    std::string const& name = (*st->presetNames)[i];
+    if (!filter.empty() && name.find(filter) == std::string::npos) continue;
+    if (!audioPath.empty()) audio.openWAV(audioPath);
+    clip = ReferenceClip(rate);
+    frame = 0;
+    fprintf(stderr, "[%zu/%zu] %s\n", i + 1, count, name.c_str());
+
+    PresetCosts::Cost cost;
+    RenderStats const& stats = renderer.getStats();
+
+    // Loading. Some of the shaders may only get built by the first
+    // frame, which is left out of the frame times.
+    compileSeconds = 0;
+    renderer.resetStats();
+    renderer.requestPresetID(i);
+    step();
+    double switchMs = stats.stage(RenderStats::PRESET_SWITCH).max() / 1000.;
+    double firstFrameMs = stats.stage(RenderStats::RENDER).max() / 1000.;
+    cost.compileMs = compileSeconds * 1000;
+    cost.parseMs = std::max(0., switchMs + firstFrameMs - cost.compileMs);
+    cost.failed = renderer.getState()->presetIndex != i;
+
+    renderer.resetStats();
+    for (int f = 0; f < frames && !cost.failed; ++f) step();
+    Histogram const& cpu = stats.stage(RenderStats::RENDER);
+    Histogram const& gpu = stats.stage(RenderStats::GPU);
+    cost.frameMeanMs = cpu.mean() / 1000;
+    cost.frameP99Ms = cpu.percentile(0.99) / 1000.;
+    cost.gpuMeanMs = gpu.mean() / 1000;
+    cost.gpuP99Ms = gpu.percentile(0.99) / 1000.;
+    table[name] = cost;
+  }
+  offline.stop();
+
+  if (!PresetCosts::save(output, ref, table)) {
+    fprintf(stderr, "Could not write %s\n", output.c_str());
+    return 1;
+  }
+  fprintf(stderr, "Wrote the costs of %zu presets to %s\n", table.size(), output.c_str());
+  return 0;
+}
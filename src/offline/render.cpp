@@ -0,0 +1,166 @@
+#include "window.hpp"
+
+#include "AudioFile.hpp"
+#include "OfflineRenderer.hpp"
+#include "../HeadlessRenderer.hpp"
+#include "util/common.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+// milkrack-render: renders an audio file to video with the plugin's
+// renderer, as fast as the machine allows.
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+	  "Usage: %s [options] INPUT OUTPUT\n"
+	  "Renders the audio in INPUT (a WAV file) to a video in OUTPUT.\n"
+	  "\n"
+	  "  -p, --presets DIR    preset directory (default: presets_projectM)\n"
+	  "  -s, --preset NAME    preset to use (default: a random one)\n"
+	  "  -a, --autoplay       cycle through presets\n"
+	  "  -W, --width N        frame width (default: 1280)\n"
+	  "  -H, --height N       frame height (default: 720)\n"
+	  "  -f, --fps N          frame rate (default: 60)\n"
+	  "  -F, --format FMT     y4m or rgba (default: y4m)\n"
+	  "  -e, --encoder CMD    pipe frames to CMD instead of writing OUTPUT\n"
+	  "  -r, --raw RATE       INPUT is raw stereo 32 bit floats at RATE Hz\n"
+	  "  -g, --gain GAIN      multiply samples by GAIN (default: 1)\n"
+	  "\n"
+	  "OUTPUT may be a named pipe. With -e, pass - as OUTPUT, e.g.:\n"
+	  "  %s -e 'ffmpeg -i - -c:v libx264 out.mp4' set.wav -\n",
+	  argv0, argv0);
+}
+
+int main(int argc, char** argv) {
+  std::string presetDir = "presets_projectM";
+  std::string presetName;
+  bool autoplay = false;
+  int rawRate = 0;
+  float gain = 1;
+  CaptureSettings capture;
+  capture.fps = 60;
+  capture.lossless = true;
+
+  static const struct option longOptions[] = {
+    {"presets", required_argument, nullptr, 'p'},
+    {"preset", required_argument, nullptr, 's'},
+    {"autoplay", no_argument, nullptr, 'a'},
+    {"width", required_argument, nullptr, 'W'},
+    {"height", required_argument, nullptr, 'H'},
+    {"fps", required_argument, nullptr, 'f'},
+    {"format", required_argument, nullptr, 'F'},
+    {"encoder", required_argument, nullptr, 'e'},
+    {"raw", required_argument, nullptr, 'r'},
+    {"gain", required_argument, nullptr, 'g'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "p:s:aW:H:f:F:e:r:g:h", longOptions, nullptr)) != -1) {
+    switch (c) {
+    case 'p': presetDir = optarg; break;
+    case 's': presetName = optarg; break;
+    case 'a': autoplay = true; break;
+    case 'W': capture.width = atoi(optarg); break;
+    case 'H': capture.height = atoi(optarg); break;
+    case 'f': capture.fps = atof(optarg); break;
+    case 'F':
+      if (!strcmp(optarg, "y4m")) {
+	capture.format = CaptureSettings::Y4M;
+      } else if (!strcmp(optarg, "rgba")) {
+	capture.format = CaptureSettings::RAW_RGBA;
+      } else {
+	usage(argv[0]);
+	return 2;
+      }
+      break;
+    case 'e': capture.command = optarg; break;
+    case 'r': rawRate = atoi(optarg); break;
+    case 'g': gain = atof(optarg); break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 2;
+    }
+  }
+  if (argc - optind != 2 || capture.width <= 0 || capture.height <= 0 || capture.fps <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  capture.path = argv[optind + 1];
+
+  AudioFile audio;
+  if (!(rawRate > 0 ? audio.openRaw(argv[optind], rawRate) : audio.openWAV(argv[optind]))) {
+    fprintf(stderr, "%s\n", audio.getError().c_str());
+    return 1;
+  }
+
+  projectM::Settings s;
+  s.presetURL = presetDir;
+  s.windowWidth = capture.width;
+  s.windowHeight = capture.height;
+  s.fps = capture.fps;
+
+  HeadlessRenderer renderer;
+  std::shared_ptr<PCMBuffer> pcm = std::make_shared<PCMBuffer>();
+  OfflineRenderer offline(&renderer);
+  if (!offline.start(s, pcm)) {
+    fprintf(stderr, "Could not start rendering, see the log above\n");
+    return 1;
+  }
+
+  if (!presetName.empty()) {
+    std::shared_ptr<const ProjectMRenderer::State> st = renderer.getState();
+    int found = -1;
+    for (size_t i = 0; st->presetNames && i < st->presetNames->size(); ++i) {
+      if ((*st->presetNames)[i].find(presetName) != std::string::npos) {
+	found = i;
+	break;
+      }
+    }
+    if (found < 0) {
+      fprintf(stderr, "No preset matching \"%s\" in %s\n", presetName.c_str(), presetDir.c_str());
+      return 1;
+    }
+    renderer.requestPresetID(found);
+  }
+  if (autoplay) renderer.requestToggleAutoplay();
+  renderer.startCapture(capture);
+
+  // Each frame gets the audio up to its end time, in one chunk
+  const int rate = audio.getSampleRate();
+  std::vector<StereoFrame> chunk(rate / capture.fps + 2);
+  uint64_t samplesFed = 0;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point lastReport = begin;
+  uint64_t frame = 0;
+  while (true) {
+    uint64_t due = (uint64_t)((frame + 1) * rate / capture.fps);
+    size_t want = std::min<uint64_t>(due - samplesFed, chunk.size());
+    size_t n = audio.read(chunk.data(), want, gain);
+    if (!n) break;
+    for (size_t i = 0; i < n; ++i) {
+      pcm->push(chunk[i].l, chunk[i].r);
+    }
+    samplesFed += n;
+    offline.step(frame / capture.fps);
+    ++frame;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - lastReport > std::chrono::seconds(1)) {
+      double elapsed = std::chrono::duration<double>(now - begin).count();
+      fprintf(stderr, "\r%.1fs rendered, %.2fx real time", (double)samplesFed / rate, samplesFed / (rate * elapsed));
+      lastReport = now;
+    }
+  }
+  // Flushes the capture
+  offline.stop();
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  fprintf(stderr, "\r%llu frames, %.1fs of audio in %.1fs (%.2fx real time)\n",
+	  (unsigned long long)frame, (double)samplesFed / rate, elapsed, samplesFed / (rate * elapsed));
+  renderer.logStats();
+  return 0;
+}
@@ -0,0 +1,24 @@
+#include "window.hpp"
+#include "util/common.hpp"
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+namespace rack {
+
+GLFWwindow* gWindow = nullptr;
+
+// Logs go to stderr, debug messages only if MILKRACK_DEBUG is set
+void loggerLog(LoggerLevel level, const char* file, int line, const char* format, ...) {
+  static const char* const kLevels[] = {"debug", "info", "warn", "fatal"};
+  static const bool debug = getenv("MILKRACK_DEBUG") != nullptr;
+  if (level == DEBUG_LEVEL && !debug) return;
+  fprintf(stderr, "[%s] %s:%d ", kLevels[level], file, line);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+#ifndef OFFLINE_SHIM_UTIL_COMMON_HPP
+#define OFFLINE_SHIM_UTIL_COMMON_HPP
+
+// Stands in for Rack's util/common.hpp when the renderer is built
+// without Rack. Only logging is needed.
+namespace rack {
+
+enum LoggerLevel {
+  DEBUG_LEVEL = 0,
+  INFO_LEVEL,
+  WARN_LEVEL,
+  FATAL_LEVEL
+};
+
+void loggerLog(LoggerLevel level, const char* file, int line, const char* format, ...);
+
+}
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef OFFLINE_SHIM_WINDOW_HPP
+#define OFFLINE_SHIM_WINDOW_HPP
+
+// Stands in for Rack's window.hpp when the renderer is built without
+// Rack. GL entry points come straight from libOpenGL instead of GLEW,
+// which works with EGL contexts too.
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GLFW/glfw3.h>
+
+namespace rack {
+
+// There is no Rack window, contexts aren't shared with anything
+extern GLFWwindow* gWindow;
+
+}
+
+#endif
@@ -0,0 +1,390 @@
+#include "window.hpp"
+
+#include "../HeadlessRenderer.hpp"
+#include "../RenderService.hpp"
+#include "../Histogram.hpp"
+#include "util/common.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+// milkrack-soak: creates and destroys renderers through the
+// RenderService over and over, the way Rack does as patches are
+// loaded and closed, while other threads switch presets, toggle
+// autoplay and change settings under them. Reports lifecycle
+// latencies, memory, threads and GL objects after each cycle, and
+// fails if any of them keeps growing once warmed up.
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t microsecondsSince(Clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t).count();
+}
+
+// Live GL objects by kind. The Makefile routes every generate and
+// delete call through these wrappers with ld --wrap.
+enum GLObjectKind {
+  TEXTURES, FRAMEBUFFERS, RENDERBUFFERS, BUFFERS, VERTEX_ARRAYS, QUERIES, SHADERS, PROGRAMS,
+  NUM_KINDS
+};
+static const char* kKindNames[NUM_KINDS] = {
+  "textures", "framebuffers", "renderbuffers", "buffers", "vertexArrays", "queries", "shaders", "programs"
+};
+static std::atomic<long> liveObjects[NUM_KINDS];
+
+extern "C" {
+
+#define WRAP_GEN_DELETE(gen, del, kind)					\
+  void __real_##gen(GLsizei n, GLuint* ids);				\
+  void __real_##del(GLsizei n, const GLuint* ids);			\
+  void __wrap_##gen(GLsizei n, GLuint* ids) {				\
+    __real_##gen(n, ids);						\
+    liveObjects[kind] += n;						\
+  }									\
+  void __wrap_##del(GLsizei n, const GLuint* ids) {			\
+    for (GLsizei i = 0; i < n; ++i) {					\
+      if (ids[i]) --liveObjects[kind];					\
+    }									\
+    __real_##del(n, ids);						\
+  }
+
+WRAP_GEN_DELETE(glGenTextures, glDeleteTextures, TEXTURES)
+WRAP_GEN_DELETE(glGenFramebuffers, glDeleteFramebuffers, FRAMEBUFFERS)
+WRAP_GEN_DELETE(glGenRenderbuffers, glDeleteRenderbuffers, RENDERBUFFERS)
+WRAP_GEN_DELETE(glGenBuffers, glDeleteBuffers, BUFFERS)
+WRAP_GEN_DELETE(glGenVertexArrays, glDeleteVertexArrays, VERTEX_ARRAYS)
+WRAP_GEN_DELETE(glGenQueries, glDeleteQueries, QUERIES)
+
+GLuint __real_glCreateShader(GLenum type);
+void __real_glDeleteShader(GLuint shader);
+GLuint __real_glCreateProgram();
+void __real_glDeleteProgram(GLuint program);
+
+GLuint __wrap_glCreateShader(GLenum type) {
+  GLuint s = __real_glCreateShader(type);
+  if (s) ++liveObjects[SHADERS];
+  return s;
+}
+
+void __wrap_glDeleteShader(GLuint shader) {
+  if (shader) --liveObjects[SHADERS];
+  __real_glDeleteShader(shader);
+}
+
+GLuint __wrap_glCreateProgram() {
+  GLuint p = __real_glCreateProgram();
+  if (p) ++liveObjects[PROGRAMS];
+  return p;
+}
+
+void __wrap_glDeleteProgram(GLuint program) {
+  if (program) --liveObjects[PROGRAMS];
+  __real_glDeleteProgram(program);
+}
+
+}
+
+static long liveGLObjects() {
+  long n = 0;
+  for (int k = 0; k < NUM_KINDS; ++k) n += liveObjects[k].load();
+  return n;
+}
+
+static long residentKB() {
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int threadCount() {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) return 0;
+  char line[256];
+  int n = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "Threads: %d", &n) == 1) break;
+  }
+  fclose(f);
+  return n;
+}
+
+// Plays the engine: pushes a little noise and a tone into every
+// renderer's PCMBuffer, from a single thread as the module would.
+class AudioFeeder {
+public:
+  explicit AudioFeeder(std::vector<std::shared_ptr<PCMBuffer> > const& pcms) : pcms(pcms) {
+    thread = std::thread([this](){ this->run(); });
+  }
+
+  ~AudioFeeder() {
+    quit.store(true);
+    thread.join();
+  }
+
+private:
+  void run() {
+    std::minstd_rand noise(1);
+    uint64_t t = 0;
+    while (!quit.load()) {
+      // 1ms at 48kHz
+      for (int i = 0; i < 48; ++i, ++t) {
+	float v = 0.5f * sinf(2 * M_PI * 110 * t / 48000.) + 0.1f * (noise() / (float)noise.max() - 0.5f);
+	for (auto& pcm : pcms) pcm->push(v, -v);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  std::vector<std::shared_ptr<PCMBuffer> > pcms;
+  std::atomic<bool> quit{false};
+  std::thread thread;
+};
+
+// Pokes at the renderers from another thread, the way menus, the
+// engine thread and keyboard shortcuts do.
+static void poke(std::vector<HeadlessRenderer*> const& rs, std::atomic<bool>* stop, unsigned seed) {
+  std::mt19937 rng(seed);
+  static const float kFrameRates[] = {15, 30, 60, 120};
+  while (!stop->load()) {
+    HeadlessRenderer* r = rs[rng() % rs.size()];
+    switch (rng() % 8) {
+    case 0:
+    case 1:
+      r->requestPresetID(kPresetIDRandom);
+      break;
+    case 2: {
+      std::shared_ptr<const ProjectMRenderer::State> st = r->getState();
+      if (st->presetNames && !st->presetNames->empty()) {
+	r->requestPresetID(rng() % st->presetNames->size());
+      }
+      break;
+    }
+    case 3:
+      r->requestToggleAutoplay();
+      break;
+    case 4:
+      r->setTargetFPS(kFrameRates[rng() % 4]);
+      break;
+    case 5:
+      r->setDynamicResolution(rng() % 2);
+      break;
+    case 6:
+      // Rebuilds projectM. Low and medium only, the others are slow
+      // under software rendering.
+      if (rng() % 8 == 0) r->setQuality(rng() % 2 ? QUALITY_LOW : QUALITY_MEDIUM);
+      break;
+    case 7:
+      r->resetStats();
+      r->listPresets();
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(200 + rng() % 1000));
+  }
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "Creates and destroys renderers repeatedly under load, and fails if\n"
+	  "memory, threads or GL objects leak.\n"
+	  "\n"
+	  "  -p, --presets DIR        preset directory (default: presets_projectM)\n"
+	  "  -c, --cycles N           create/destroy cycles (default: 200)\n"
+	  "  -n, --instances N        renderers per cycle (default: 4)\n"
+	  "  -l, --load MS            time spent poking at them per cycle (default: 300)\n"
+	  "  -t, --threads N          threads poking at them (default: 4)\n"
+	  "  -w, --warmup N           cycles before taking baselines (default: 5)\n"
+	  "  -r, --max-rss-growth MB  allowed memory growth after warmup (default: 32)\n"
+	  "  -R, --max-retire-us N    allowed UI thread time per teardown (default: 1000)\n"
+	  "  -T, --timeout S          time allowed to start or stop a cycle (default: 30)\n",
+	  argv0);
+}
+
+int main(int argc, char** argv) {
+  std::string presetDir = "presets_projectM";
+  int cycles = 200;
+  int instances = 4;
+  int loadMs = 300;
+  int threads = 4;
+  int warmup = 5;
+  long maxRSSGrowthMB = 32;
+  uint64_t maxRetireUs = 1000;
+  int timeoutS = 30;
+
+  static const struct option longOptions[] = {
+    {"presets", required_argument, nullptr, 'p'},
+    {"cycles", required_argument, nullptr, 'c'},
+    {"instances", required_argument, nullptr, 'n'},
+    {"load", required_argument, nullptr, 'l'},
+    {"threads", required_argument, nullptr, 't'},
+    {"warmup", required_argument, nullptr, 'w'},
+    {"max-rss-growth", required_argument, nullptr, 'r'},
+    {"max-retire-us", required_argument, nullptr, 'R'},
+    {"timeout", required_argument, nullptr, 'T'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "p:c:n:l:t:w:r:R:T:h", longOptions, nullptr)) != -1) {
+    switch (c) {
+    case 'p': presetDir = optarg; break;
+    case 'c': cycles = atoi(optarg); break;
+    case 'n': instances = atoi(optarg); break;
+    case 'l': loadMs = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'r': maxRSSGrowthMB = atol(optarg); break;
+    case 'R': maxRetireUs = strtoull(optarg, nullptr, 10); break;
+    case 'T': timeoutS = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 2;
+    }
+  }
+  if (optind != argc || cycles <= warmup || instances <= 0 || threads < 0 || loadMs < 0 || timeoutS <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  projectM::Settings s;
+  s.presetURL = presetDir;
+  s.windowWidth = 128;
+  s.windowHeight = 128;
+
+  RenderService& service = RenderService::get();
+  const std::chrono::seconds timeout(timeoutS);
+  // Whole run, in microseconds
+  Histogram startLatency; // init() to first frame
+  Histogram initTime, retireTime, pumpTime; // Spent on the calling thread
+  Histogram teardownLatency; // Retiring a cycle's renderers to all deleted
+  long baseRSS = 0, baseGL = 0;
+  int baseThreads = 0;
+  bool failed = false;
+
+  for (int cycle = 1; cycle <= cycles && !failed; ++cycle) {
+    std::vector<HeadlessRenderer*> rs;
+    std::vector<std::shared_ptr<PCMBuffer> > pcms;
+    std::vector<Clock::time_point> initAt;
+    std::vector<bool> started(instances, false);
+    for (int i = 0; i < instances; ++i) {
+      pcms.push_back(std::make_shared<PCMBuffer>());
+      rs.push_back(new HeadlessRenderer);
+      Clock::time_point t = Clock::now();
+      rs.back()->init(s, pcms.back());
+      initTime.record(microsecondsSince(t));
+      initAt.push_back(t);
+    }
+    AudioFeeder feeder(pcms);
+
+    // Up, as the UI thread would see it
+    Clock::time_point deadline = Clock::now() + timeout;
+    for (int pending = instances; pending && !failed;) {
+      Clock::time_point t = Clock::now();
+      service.pump();
+      pumpTime.record(microsecondsSince(t));
+      for (int i = 0; i < instances; ++i) {
+	if (started[i] || rs[i]->isStarting()) continue;
+	started[i] = true;
+	--pending;
+	startLatency.record(microsecondsSince(initAt[i]));
+	if (!rs[i]->isRendering()) {
+	  fprintf(stderr, "cycle %d: renderer %d failed to start\n", cycle, i);
+	  failed = true;
+	}
+      }
+      if (Clock::now() > deadline) {
+	fprintf(stderr, "cycle %d: renderers still starting after %ds\n", cycle, timeoutS);
+	failed = true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Under load
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> pokers;
+    for (int i = 0; i < threads && !failed; ++i) {
+      pokers.push_back(std::thread(poke, std::cref(rs), &stop, (unsigned)(cycle * 1000 + i)));
+    }
+    Clock::time_point loadEnd = Clock::now() + std::chrono::milliseconds(failed ? 0 : loadMs);
+    while (Clock::now() < loadEnd) {
+      service.pump();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop.store(true);
+    for (std::thread& t : pokers) t.join();
+
+    // Down
+    Clock::time_point teardownStart = Clock::now();
+    for (HeadlessRenderer* r : rs) {
+      Clock::time_point t = Clock::now();
+      r->retire();
+      retireTime.record(microsecondsSince(t));
+    }
+    deadline = Clock::now() + timeout;
+    while (service.pendingCount()) {
+      if (Clock::now() > deadline) {
+	fprintf(stderr, "cycle %d: renderers still stopping after %ds\n", cycle, timeoutS);
+	return 1; // Something is stuck, tearing down would hang too
+      }
+      service.pump();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    teardownLatency.record(microsecondsSince(teardownStart));
+
+    long rss = residentKB();
+    long gl = liveGLObjects();
+    int nthreads = threadCount();
+    if (cycle == warmup) {
+      baseRSS = rss;
+      baseGL = gl;
+      baseThreads = nthreads;
+    }
+    printf("cycle %d: start p50 %.1f max %.1f ms, retire max %llu us, teardown %.1f ms, rss %.1f MB, threads %d, gl objects %ld\n",
+	   cycle, startLatency.percentile(0.5) / 1000., startLatency.max() / 1000.,
+	   (unsigned long long)retireTime.max(), teardownLatency.max() / 1000., rss / 1024., nthreads, gl);
+    fflush(stdout);
+  }
+
+  long rss = residentKB();
+  long gl = liveGLObjects();
+  int nthreads = threadCount();
+  printf("\n");
+  printf("start latency      p50 %8.2f  p99 %8.2f  max %8.2f ms\n", startLatency.percentile(0.5) / 1000., startLatency.percentile(0.99) / 1000., startLatency.max() / 1000.);
+  printf("teardown latency   p50 %8.2f  p99 %8.2f  max %8.2f ms\n", teardownLatency.percentile(0.5) / 1000., teardownLatency.percentile(0.99) / 1000., teardownLatency.max() / 1000.);
+  printf("init() call        p50 %8llu  p99 %8llu  max %8llu us\n", (unsigned long long)initTime.percentile(0.5), (unsigned long long)initTime.percentile(0.99), (unsigned long long)initTime.max());
+  printf("retire() call      p50 %8llu  p99 %8llu  max %8llu us\n", (unsigned long long)retireTime.percentile(0.5), (unsigned long long)retireTime.percentile(0.99), (unsigned long long)retireTime.max());
+  printf("pump() call        p50 %8llu  p99 %8llu  max %8llu us\n", (unsigned long long)pumpTime.percentile(0.5), (unsigned long long)pumpTime.percentile(0.99), (unsigned long long)pumpTime.max());
+  printf("GL objects left:");
+  for (int k = 0; k < NUM_KINDS; ++k) printf(" %s %ld", kKindNames[k], liveObjects[k].load());
+  printf("\n");
+  if (failed) return 1;
+
+  // Regressions, against the end of the warmup
+  if (rss - baseRSS > maxRSSGrowthMB * 1024) {
+    fprintf(stderr, "FAIL: memory grew by %.1f MB after warmup\n", (rss - baseRSS) / 1024.);
+    failed = true;
+  }
+  if (gl > baseGL) {
+    fprintf(stderr, "FAIL: %ld more GL objects alive than after warmup\n", gl - baseGL);
+    failed = true;
+  }
+  if (nthreads > baseThreads) {
+    fprintf(stderr, "FAIL: %d more threads than after warmup\n", nthreads - baseThreads);
+    failed = true;
+  }
+  if (retireTime.percentile(0.99) > maxRetireUs) {
+    fprintf(stderr, "FAIL: retire() p99 is %llu us\n", (unsigned long long)retireTime.percentile(0.99));
+    failed = true;
+  }
+  if (!failed) printf("OK\n");
+  return failed ? 1 : 0;
+}